@@ -23,6 +23,19 @@
 #ifndef AVL_H
 #define AVL_H
 
+#include <stddef.h>
+
+  /**
+   *  @def AVL_MAX_HEIGHT
+   *  @brief upper bound on the height of any AVL tree this library can hold
+   *
+   *  An AVL tree of height h contains at least F(h+2)-1 nodes, so even a
+   *  tree with 2^64 nodes is under 93 levels deep.  Used to size the
+   *  explicit path stacks in the iterative engines and in @a avl_iter.
+   */
+
+#define AVL_MAX_HEIGHT 96
+
   /**
    *  @enum avl_order
    *  @brief AVL traversal order, used by avl_walk
@@ -37,6 +50,38 @@ typedef enum
   avl_tree_order      /**< Level-order, level 1 (root), then level 2, level 3 ... */
 } avl_order;
 
+  /**
+   *  @enum avl_key_kind
+   *  @brief built-in key flavor of a tree, selected at creation time
+   *
+   *  Trees created through avl_new_i64()/avl_new_u64()/avl_new_str()/
+   *  avl_new_memcmp() compare keys inline in the descent loops, with no
+   *  indirect comparator call per level.  avl_key_custom is the generic
+   *  flavor driven by the avl_set_cmp()/avl_set_cmp_key() functions.
+   */
+
+typedef enum
+{
+  avl_key_custom,  /**< user supplied comparator functions                 */
+  avl_key_i64,     /**< value is a signed integer coerced into the pointer  */
+  avl_key_u64,     /**< value is an unsigned integer coerced into the pointer */
+  avl_key_str,     /**< value points to a NUL-terminated string             */
+  avl_key_mem      /**< value points to a fixed-size byte key               */
+} avl_key_kind;
+
+  /**
+   *  @enum avl_engine
+   *  @brief rebalancing engine used by a tree's insert path
+   */
+
+typedef enum
+{
+  avl_engine_bottom_up,  /**< descend, then retrace heights until stable  */
+  avl_engine_top_down    /**< single pass: the lowest unbalanced ancestor
+                              is remembered on the way down and fixed
+                              with at most one rotation, no unwinding     */
+} avl_engine;
+
   /**
    *  @typedef struct avl_node avl_node
    *  @brief   creates a type for @a avl_node struct
@@ -47,14 +92,42 @@ typedef struct avl_node avl_node;
   /**
    *  @struct avl_node
    *  @brief AVL node structure
+   *
+   *  Nodes are normally heap-allocated through avl_node_new(), but an
+   *  @a avl_node may also be embedded directly in a caller record and
+   *  prepared with avl_node_init(), so the key bytes share a cache line
+   *  with the links instead of sitting behind the @a value pointer:
+   *
+   *  @code
+   *    struct record { long key; avl_node node; ... };
+   *    #define record_of(n) \
+   *      ((struct record *)((char *)(n) - offsetof(struct record, node)))
+   *  @endcode
+   *
+   *  with a comparator that reads record_of(a)->key.  Intrusive trees
+   *  must set a free_node function (avl_set_free()) that releases the
+   *  containing record - or does nothing, when records outlive the
+   *  tree - since the default free(node) would not point at an
+   *  allocation of its own.
    */
 
 struct avl_node
 {
-  avl_node *left;   /**<  points to left (lesser) node    */
-  avl_node *right;  /**<  points to right (greater) node  */
-  int height;       /**<  current height of node          */
-  void *value;      /**<  generic key value for node      */
+  avl_node *left;       /**<  points to left (lesser) node                 */
+  avl_node *right;      /**<  points to right (greater) node               */
+  avl_node *parent;     /**<  points to parent node, NULL at the root;
+                              not maintained across snapshot sharing        */
+  unsigned size;        /**<  number of nodes in sub-tree rooted here,
+                              including this one; maintained by the
+                              library and read by the order-statistics
+                              queries.  32 bits caps a tree at 2^32-1
+                              nodes, matching the compact backend          */
+  short height;         /**<  current height of node; AVL height never
+                              exceeds AVL_MAX_HEIGHT                       */
+  unsigned short refs;  /**<  number of tree versions referencing this
+                              node; 1 except under snapshot sharing, and
+                              capped by refusing further snapshots         */
+  void *value;          /**<  generic key value for node                   */
 };
 
   /**
@@ -89,6 +162,18 @@ typedef void (*avl_free_node)(avl_node *node);
 
 typedef int (*avl_cmp_node)(avl_node *a, avl_node *b);
 
+  /**
+   *  @typedef int (*avl_cmp_key)(const void *key, avl_node *n);
+   *  @brief   creates a type for function prototype to compare a bare key
+   *           against an @a avl_node
+   *
+   *  Drives the _key variants of find and delete, which skip the
+   *  construction of a throwaway target node.  Must order keys the same
+   *  way as the tree's @a avl_cmp_node function.
+   */
+
+typedef int (*avl_cmp_key)(const void *key, avl_node *n);
+
   /**
    *  @typedef int (*avl_action)(avl_node *n)
    *  @brief   creates a type for function prototype used by @a avl_walk
@@ -96,6 +181,102 @@ typedef int (*avl_cmp_node)(avl_node *a, avl_node *b);
 
 typedef int (*avl_action)(avl_node *n);
 
+  /**
+   *  @typedef int (*avl_value_save)(int fd, void *value);
+   *  @brief   creates a type for function prototype used by avl_save()
+   *           to serialize one node value to a file descriptor
+   */
+
+typedef int (*avl_value_save)(int fd, void *value);
+
+  /**
+   *  @typedef int (*avl_value_load)(int fd, void **value);
+   *  @brief   creates a type for function prototype used by avl_load()
+   *           to deserialize one node value from a file descriptor
+   */
+
+typedef int (*avl_value_load)(int fd, void **value);
+
+  /**
+   *  @typedef struct avl_stats avl_stats
+   *  @brief   creates a type for @a avl_stats struct
+   */
+
+typedef struct avl_stats avl_stats;
+
+  /**
+   *  @struct avl_stats
+   *  @brief hot-path counters collected when avl_set_stats() is on
+   *
+   *  Answers "is the comparator slow or is the churn pathological"
+   *  without attaching a profiler: comparator and allocation volume,
+   *  rotation counts, and descent/retrace depths.  On concurrent trees
+   *  the reader-path counters (compares, finds, find depths) are not
+   *  collected at all - readers hold only the shared lock, and updating
+   *  shared counters there would be a data race; the writer-path
+   *  counters remain exact.
+   */
+
+struct avl_stats
+{
+  size_t compares;              /**<  comparator invocations, built-in
+                                      flavors included                    */
+  size_t rotations;             /**<  single rotations performed          */
+  size_t node_allocs;           /**<  nodes created by the library        */
+  size_t finds;                 /**<  find descents                       */
+  size_t find_depth_total;      /**<  levels visited across all finds     */
+  size_t find_depth_max;        /**<  deepest single find                 */
+  size_t inserts;               /**<  insert descents                     */
+  size_t insert_retrace_total;  /**<  levels walked by insert retraces    */
+  size_t deletes;               /**<  delete descents                     */
+  size_t delete_retrace_total;  /**<  levels walked by delete retraces    */
+};
+
+  /**
+   *  @typedef struct avl_shape avl_shape
+   *  @brief   creates a type for @a avl_shape struct
+   */
+
+typedef struct avl_shape avl_shape;
+
+  /**
+   *  @struct avl_shape
+   *  @brief shape-quality report filled by avl_get_shape()
+   */
+
+struct avl_shape
+{
+  size_t nodes;           /**<  number of nodes in the tree               */
+  int height;             /**<  actual tree height                        */
+  int optimal_height;     /**<  ceil(log2(nodes+1)), the best possible    */
+  double avg_depth;       /**<  mean node depth, root at depth 1          */
+  size_t leaves;          /**<  nodes with no children                    */
+  size_t min_leaf_depth;  /**<  shallowest leaf                           */
+  size_t max_leaf_depth;  /**<  deepest leaf                              */
+};
+
+  /**
+   *  @typedef struct avl_arena avl_arena
+   *  @brief   creates a type for opaque @a avl_arena struct
+   *
+   *  An arena carves nodes out of large contiguous slabs and recycles
+   *  freed nodes through an internal freelist.  The arena itself is
+   *  managed entirely by the library.
+   */
+
+typedef struct avl_arena avl_arena;
+
+  /**
+   *  @typedef struct avl_lock avl_lock
+   *  @brief   creates a type for opaque @a avl_lock struct
+   *
+   *  Present on trees created with avl_new_concurrent(): readers run
+   *  concurrently, writers are serialized among themselves and against
+   *  readers.
+   */
+
+typedef struct avl_lock avl_lock;
+
   /**
    *  @typedef struct avl avl
    *  @brief   creates a type for @a avl struct
@@ -116,6 +297,48 @@ struct avl
   avl_dup_node dup_node;    /**<  user supplied function to duplicate an @a avl_node         */
   avl_free_node free_node;  /**<  user supplied function to free an a @a avl_node            */
   avl_cmp_node cmp_node;    /**<  user supplied function to compare two @a avl_node structs  */
+  avl_cmp_key cmp_key;      /**<  user supplied function to compare a key to an @a avl_node  */
+  avl_arena *arena;         /**<  optional slab arena that nodes are carved from             */
+  avl_lock *lock;           /**<  optional reader-writer lock for concurrent mode            */
+  int persistent;           /**<  non-zero once snapshots share nodes with this tree         */
+  int frozen;               /**<  non-zero on snapshot handles; mutations are refused        */
+  avl_key_kind key_kind;    /**<  built-in key flavor; custom uses the comparator slots      */
+  size_t key_len;           /**<  key size in bytes for the avl_key_mem flavor               */
+  int multi;                /**<  non-zero for multiset trees: equal keys bump an in-node
+                                  occurrence count instead of being dropped                   */
+  avl_node *recycle_list;   /**<  freelist of deleted nodes awaiting reuse, linked
+                                  through their right pointers                               */
+  size_t recycle_count;     /**<  nodes currently parked on the freelist                     */
+  size_t recycle_limit;     /**<  freelist bound set by avl_set_recycle(), 0 when off        */
+  avl_engine engine;        /**<  insert rebalancing engine, bottom-up by default            */
+  int stats_on;             /**<  non-zero while hot-path counters are collected             */
+  avl_stats stats;          /**<  the counters themselves, see avl_get_stats()               */
+};
+
+  /**
+   *  @typedef struct avl_iter avl_iter
+   *  @brief   creates a type for @a avl_iter struct
+   */
+
+typedef struct avl_iter avl_iter;
+
+  /**
+   *  @struct avl_iter
+   *  @brief cursor over an AVL tree, holding an explicit descent stack
+   *
+   *  Supports pausable, batchable traversal in @a avl_forward_order or
+   *  @a avl_reverse_order with no callback invocation per node.  The
+   *  tree must not be modified while a cursor is open on it.
+   */
+
+struct avl_iter
+{
+  avl *tree;                        /**<  tree being traversed                */
+  avl_order order;                  /**<  traversal direction                 */
+  int depth;                        /**<  number of pending nodes on path     */
+  avl_node *hi;                     /**<  inclusive upper bound for a range
+                                          cursor, NULL when unbounded         */
+  avl_node *path[AVL_MAX_HEIGHT];   /**<  stack of nodes still to be visited  */
 };
 
   /*
@@ -123,22 +346,165 @@ struct avl
    */
 
 avl *avl_new(void);
+avl *avl_new_with_arena(size_t nodes_per_slab);
+avl *avl_new_concurrent(void);
+avl *avl_new_i64(void);
+avl *avl_new_u64(void);
+avl *avl_new_str(void);
+avl *avl_new_memcmp(size_t len);
 avl *avl_dup(avl *tree);
+avl *avl_dup_parallel(avl *tree, int nthreads);
+avl *avl_snapshot(avl *tree);
 void avl_free(avl *tree);
 int avl_insert(avl *tree, avl_node *item);
+int avl_insert_value(avl *tree, void *value);
+int avl_insert_batch(avl *tree, avl_node **items, size_t n);
+int avl_build_sorted(avl *tree, avl_node **items, size_t n);
 int avl_delete(avl *tree, avl_node *target);
+int avl_join(avl *left, avl *right);
+int avl_split(avl *tree, avl_node *pivot, avl **lo, avl **hi);
+int avl_delete_key(avl *tree, const void *key);
+int avl_save(avl *tree, int fd, avl_value_save save_value);
+avl *avl_load(int fd, avl_value_load load_value);
 avl_node *avl_find(avl *tree, avl_node *target);
+avl_node *avl_find_or_insert(avl *tree, avl_node *item, int *inserted);
+avl_node *avl_find_key(avl *tree, const void *key);
+size_t avl_find_many(avl *tree, avl_node **targets, avl_node **results,
+                     size_t n);
+avl_node *avl_select(avl *tree, size_t k);
+avl_node *avl_first(avl *tree);
+avl_node *avl_last(avl *tree);
+avl_node *avl_next(avl_node *node);
+avl_node *avl_prev(avl_node *node);
+size_t avl_rank(avl *tree, avl_node *target);
+size_t avl_count(avl *tree);
+size_t avl_memsize(avl *tree);
+int avl_get_shape(avl *tree, avl_shape *out);
 void avl_walk(avl *tree, avl_order order, avl_action action);
+size_t avl_to_array(avl *tree, void **values, size_t cap);
+size_t avl_to_node_array(avl *tree, avl_node **nodes, size_t cap);
+void avl_walk_range(avl *tree, avl_node *lo, avl_node *hi, avl_action action);
+void avl_walk_parallel(avl *tree, avl_order order, avl_action action,
+                       int nthreads);
 void avl_set_new(avl *tree, avl_new_node new_node);
 void avl_set_dup(avl *tree, avl_dup_node dup_node);
 void avl_set_free(avl *tree, avl_free_node free_node);
 void avl_set_cmp(avl *tree, avl_cmp_node cmp_node);
+void avl_set_cmp_key(avl *tree, avl_cmp_key cmp_key);
+int avl_set_multi(avl *tree, int multi);
+int avl_set_recycle(avl *tree, size_t limit);
+int avl_set_engine(avl *tree, avl_engine engine);
+void avl_recycle_trim(avl *tree, size_t keep);
+void avl_set_stats(avl *tree, int enable);
+int avl_get_stats(avl *tree, avl_stats *out);
+
+  /**
+   *  @typedef int (*avl_value_action)(void *value)
+   *  @brief   creates a type for function prototype used by
+   *           avl_compact_walk()
+   */
+
+typedef int (*avl_value_action)(void *value);
+
+  /**
+   *  @typedef struct avl_compact avl_compact
+   *  @brief   creates a type for @a avl_compact struct
+   */
+
+typedef struct avl_compact avl_compact;
+
+  /**
+   *  @struct avl_compact
+   *  @brief read-only, array-backed compact tree
+   *
+   *  Nodes live in one contiguous array and link through 32-bit indices
+   *  instead of pointers: 16 bytes per node on LP64 against the 40 of
+   *  @a avl_node, with index arithmetic that prefetches well.  Built
+   *  from an existing tree with avl_compact_from(); supports find and
+   *  walk but no mutation - rebuild from the live tree to refresh.
+   */
+
+struct avl_compact
+{
+  struct avl_cnode *nodes;  /**<  contiguous node array                    */
+  unsigned count;           /**<  number of nodes                          */
+  unsigned root;            /**<  index of root node, AVL_COMPACT_NIL when
+                                  empty                                    */
+  avl_key_kind key_kind;    /**<  key flavor copied from the source tree   */
+  size_t key_len;           /**<  key size for the avl_key_mem flavor      */
+  avl_cmp_key cmp_key;      /**<  key comparator for the custom flavor     */
+  int owns_nodes;           /**<  non-zero when the array is heap-owned    */
+  void *map_base;           /**<  mmap base when loaded via
+                                  avl_compact_map(), NULL otherwise        */
+  size_t map_len;           /**<  mmap length for avl_compact_map() trees  */
+};
+
+  /**
+   *  @def AVL_COMPACT_NIL
+   *  @brief index value marking an absent child in @a avl_compact
+   */
+
+#define AVL_COMPACT_NIL 0xffffffffu
+
+  /**
+   *  @typedef struct avl_loader avl_loader
+   *  @brief   creates a type for @a avl_loader struct
+   */
+
+typedef struct avl_loader avl_loader;
+
+  /**
+   *  @struct avl_loader
+   *  @brief streaming loader handle for near-sorted input
+   *
+   *  Keeps the tree's rightmost node hot: keys arriving in order are
+   *  appended next to it with one comparison and a short retrace,
+   *  instead of a full root-to-leaf descent per record.  Out-of-order
+   *  keys fall back to the normal insert engine transparently.
+   */
+
+struct avl_loader
+{
+  avl *tree;        /**<  tree being loaded                      */
+  avl_node *hot;    /**<  current maximum node, the append hint  */
+};
+
+  /*
+   *  AVL LOADER functions
+   */
+
+avl_loader *avl_loader_begin(avl *tree);
+int avl_loader_add(avl_loader *loader, avl_node *node);
+int avl_loader_end(avl_loader *loader);
+
+  /*
+   *  AVL COMPACT functions
+   */
+
+avl_compact *avl_compact_from(avl *tree);
+void *avl_compact_find(avl_compact *compact, const void *key);
+size_t avl_compact_count(avl_compact *compact);
+int avl_compact_walk(avl_compact *compact, avl_value_action action);
+int avl_compact_save(avl_compact *compact, int fd);
+avl_compact *avl_compact_map(int fd);
+void avl_compact_free(avl_compact *compact);
+
+  /*
+   *  AVL ITER functions
+   */
+
+avl_iter *avl_iter_begin(avl *tree, avl_order order);
+avl_iter *avl_iter_begin_range(avl *tree, avl_node *lo, avl_node *hi);
+avl_node *avl_iter_next(avl_iter *iter);
+int avl_iter_seek(avl_iter *iter, avl_node *target);
+void avl_iter_end(avl_iter *iter);
 
   /*
    *  AVL NODE functions
    */
 
 avl_node *avl_node_new(avl *tree, void *value);
+void avl_node_init(avl_node *node, void *value);
 avl_node *avl_node_dup(avl *tree, avl_node *node);
 void avl_node_free(avl *tree, avl_node *node);
 int avl_node_cmp(avl *tree, avl_node *a, avl_node *b);
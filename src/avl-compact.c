@@ -0,0 +1,542 @@
+/*
+ *  Copyright 2021,2024,2025 Patrick T. Head
+ *
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file avl-compact.c
+ * @brief Read-only, array-backed compact backend for the AVL library
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "avl.h"
+
+  /**
+   *  @struct avl_cnode
+   *  @brief one compact node: two 32-bit child indices plus the value
+   */
+
+struct avl_cnode
+{
+  unsigned left;    /**<  index of left child, AVL_COMPACT_NIL if none   */
+  unsigned right;   /**<  index of right child, AVL_COMPACT_NIL if none  */
+  void *value;      /**<  generic key value for node                     */
+};
+
+typedef struct avl_cnode avl_cnode;
+
+  /**
+   *  @def AVL_COMPACT_MAX_DEPTH
+   *  @brief deepest descent any valid compact tree can need
+   *
+   *  The node array caps at 2^32-1 entries and the shapes the library
+   *  builds are height-balanced, so no honest image nests anywhere near
+   *  this; the cap contains index cycles in corrupt mapped images.
+   */
+
+#define AVL_COMPACT_MAX_DEPTH 64
+
+  /**
+   *  @def AVL_COMPACT_MAGIC
+   *  @brief magic number opening an avl_compact_save() image
+   */
+
+#define AVL_COMPACT_MAGIC 0x31434c41u  /* "ALC1" */
+
+  /**
+   *  @struct avl_compact_header
+   *  @brief fixed-size header of an avl_compact_save() image
+   *
+   *  Sized so the node array that follows starts 16-byte aligned, and
+   *  the in-memory @a avl_cnode layout can be mapped directly.
+   */
+
+struct avl_compact_header
+{
+  uint32_t magic;      /**<  AVL_COMPACT_MAGIC              */
+  uint32_t count;      /**<  number of nodes in the image   */
+  uint32_t root;       /**<  index of the root node         */
+  uint32_t key_kind;   /**<  key flavor of the saved tree   */
+  uint64_t key_len;    /**<  key size for the mem flavor    */
+  uint64_t reserved;   /**<  padding up to 32 bytes         */
+};
+
+static int compact_key_cmp(const avl_compact *compact,
+                           const void *key,
+                           const avl_cnode *node);
+static int compact_write_all(int fd, const void *data, size_t len);
+static unsigned compact_link(avl_cnode *nodes, unsigned lo, unsigned hi);
+static int compact_walk(const avl_compact *compact,
+                        unsigned index,
+                        int depth,
+                        avl_value_action action);
+
+  /*
+   * public functions
+   */
+
+  /**
+   *  @fn avl_compact *avl_compact_from(avl *tree)
+   *
+   *  @brief build a compact read-only copy of @p tree
+   *
+   *  The tree's values are laid out in key order in one contiguous
+   *  array and linked into a height-balanced shape through 32-bit
+   *  indices by midpoint splitting.  The key flavor (or cmp_key
+   *  function, for custom trees) is carried over so avl_compact_find()
+   *  orders keys identically.  Values are shared with the source tree,
+   *  not copied.  Multiset trees are refused; the compact form carries
+   *  no occurrence counts.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *
+   *  @return pointer to new @a avl_compact, or NULL on failure
+   */
+
+avl_compact *avl_compact_from(avl *tree)
+{
+  avl_compact *compact = NULL;
+  avl_iter *iter = NULL;
+  avl_node *node;
+  size_t count;
+  unsigned next;
+
+  if (!tree) goto exit;
+  if (tree->key_kind == avl_key_custom && !tree->cmp_key) goto exit;
+
+    /*
+     * multiset trees are refused: avl_count() weights keys by
+     * occurrence there, so it no longer matches the number of distinct
+     * nodes a cursor fill yields, and the compact form has nowhere to
+     * keep the multiplicities anyway
+     */
+
+  if (tree->multi) goto exit;
+
+    /*
+     * the cursor holds the tree's read lock (when it has one) for the
+     * whole conversion, so a concurrent writer cannot pull the tree out
+     * from under the fill
+     */
+
+  iter = avl_iter_begin(tree, avl_forward_order);
+  if (!iter) goto exit;
+
+    /*
+     * the cursor already holds the read lock; taking it again through
+     * avl_count() is unspecified when a writer is queued, so read the
+     * count directly
+     */
+
+  count = tree->root ? tree->root->size : 0;
+  if (count >= AVL_COMPACT_NIL) goto exit;
+
+  compact = malloc(sizeof(avl_compact));
+  if (!compact) goto exit;
+
+  memset(compact, 0, sizeof(avl_compact));
+  compact->count = (unsigned)count;
+  compact->root = AVL_COMPACT_NIL;
+  compact->key_kind = tree->key_kind;
+  compact->key_len = tree->key_len;
+  compact->cmp_key = tree->cmp_key;
+  compact->owns_nodes = 1;
+
+  if (!count) goto exit;
+
+  compact->nodes = malloc(count * sizeof(avl_cnode));
+  if (!compact->nodes)
+  {
+    free(compact);
+    compact = NULL;
+    goto exit;
+  }
+
+  next = 0;
+  while ((node = avl_iter_next(iter))) compact->nodes[next++].value = node->value;
+
+  compact->root = compact_link(compact->nodes, 0, compact->count);
+
+exit:
+  if (iter) avl_iter_end(iter);
+  return compact;
+}
+
+  /**
+   *  @fn void *avl_compact_find(avl_compact *compact, const void *key)
+   *
+   *  @brief searches @p compact for the value matching @p key
+   *
+   *  Note that a stored NULL value is indistinguishable from a miss;
+   *  intrinsic-key flavors storing the key 0 should bias it, or keep
+   *  using the pointer-based tree.
+   *
+   *  @param compact - pointer to existing @a avl_compact
+   *  @param key - bare key to search for
+   *
+   *  @return the stored value on success, NULL on failure
+   */
+
+void *avl_compact_find(avl_compact *compact, const void *key)
+{
+  unsigned index;
+  avl_cnode *node;
+  int pos;
+  int depth = 0;
+
+  if (!compact || !compact->nodes) return NULL;
+
+  index = compact->root;
+  while (index != AVL_COMPACT_NIL)
+  {
+      /*
+       * a corrupt mapped image must not walk out of the array or chase
+       * an index cycle forever
+       */
+
+    if ((index >= compact->count) || (depth++ >= AVL_COMPACT_MAX_DEPTH))
+      return NULL;
+
+    node = &compact->nodes[index];
+    pos = compact_key_cmp(compact, key, node);
+    if (pos == 0) return node->value;
+    index = (pos < 0) ? node->left : node->right;
+  }
+
+  return NULL;
+}
+
+  /**
+   *  @fn size_t avl_compact_count(avl_compact *compact)
+   *
+   *  @brief returns the number of values in @p compact
+   *
+   *  @param compact - pointer to existing @a avl_compact
+   *
+   *  @return value count, 0 for an empty or NULL compact tree
+   */
+
+size_t avl_compact_count(avl_compact *compact)
+{
+  if (!compact) return 0;
+  return compact->count;
+}
+
+  /**
+   *  @fn int avl_compact_walk(avl_compact *compact, avl_value_action action)
+   *
+   *  @brief calls @p action on every value of @p compact in key order
+   *
+   *  The walk stops early as soon as @p action returns non-zero.
+   *
+   *  @param compact - pointer to existing @a avl_compact
+   *  @param action - function that gets called for each value
+   *
+   *  @return non-zero when @p action requested an early stop
+   */
+
+int avl_compact_walk(avl_compact *compact, avl_value_action action)
+{
+  if (!compact || !action) return 0;
+
+  return compact_walk(compact, compact->root, 0, action);
+}
+
+  /**
+   *  @fn int avl_compact_save(avl_compact *compact, int fd)
+   *
+   *  @brief write the raw node array of @p compact to @p fd
+   *
+   *  Only the intrinsic key flavors (avl_key_i64/avl_key_u64) can be
+   *  saved: their values are whole inside the image, so the file can be
+   *  mapped back with avl_compact_map() and searched without any
+   *  rebuild - startup becomes an mmap with page faults on demand.
+   *  The image is native-endian and assumes the saving and mapping
+   *  machines share an architecture.
+   *
+   *  @param compact - pointer to existing @a avl_compact
+   *  @param fd - writable file descriptor
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_compact_save(avl_compact *compact, int fd)
+{
+  struct avl_compact_header header;
+
+  if (!compact || (fd < 0)) return -1;
+  if ((compact->key_kind != avl_key_i64)
+      && (compact->key_kind != avl_key_u64)) return -1;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = AVL_COMPACT_MAGIC;
+  header.count = compact->count;
+  header.root = compact->root;
+  header.key_kind = (uint32_t)compact->key_kind;
+  header.key_len = compact->key_len;
+
+  if (compact_write_all(fd, &header, sizeof(header))) return -1;
+  if (compact->count
+      && compact_write_all(fd, compact->nodes,
+                           (size_t)compact->count * sizeof(avl_cnode)))
+    return -1;
+
+  return 0;
+}
+
+  /**
+   *  @fn avl_compact *avl_compact_map(int fd)
+   *
+   *  @brief map an avl_compact_save() image without reading it
+   *
+   *  The node array is used straight out of the mapping: no parsing,
+   *  no allocation per node, pages fault in as the tree is searched.
+   *  The descriptor may be closed after mapping.
+   *
+   *  @param fd - readable file descriptor of an image file
+   *
+   *  @return pointer to new @a avl_compact, or NULL on failure
+   */
+
+avl_compact *avl_compact_map(int fd)
+{
+  avl_compact *compact = NULL;
+  struct avl_compact_header *header;
+  struct stat st;
+  void *base;
+  size_t need;
+
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st)) return NULL;
+  if ((size_t)st.st_size < sizeof(*header)) return NULL;
+
+  base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) return NULL;
+
+  header = base;
+  need = sizeof(*header) + (size_t)header->count * sizeof(avl_cnode);
+
+    /*
+     * the root index is validated here; child indices are checked
+     * per step during descents and walks, which touches no page the
+     * traversal would not fault in anyway.  Only the intrinsic key
+     * flavors are accepted - avl_compact_save() never writes anything
+     * else, and a corrupt kind would send the comparators through
+     * value pointers read straight from the file
+     */
+
+  if ((header->magic != AVL_COMPACT_MAGIC)
+      || ((size_t)st.st_size < need)
+      || ((header->root != AVL_COMPACT_NIL) && (header->root >= header->count))
+      || ((header->key_kind != (uint32_t)avl_key_i64)
+          && (header->key_kind != (uint32_t)avl_key_u64)))
+  {
+    munmap(base, (size_t)st.st_size);
+    return NULL;
+  }
+
+  compact = malloc(sizeof(avl_compact));
+  if (!compact)
+  {
+    munmap(base, (size_t)st.st_size);
+    return NULL;
+  }
+
+  memset(compact, 0, sizeof(avl_compact));
+  compact->nodes = (avl_cnode *)((char *)base + sizeof(*header));
+  compact->count = header->count;
+  compact->root = header->root;
+  compact->key_kind = (avl_key_kind)header->key_kind;
+  compact->key_len = (size_t)header->key_len;
+  compact->owns_nodes = 0;
+  compact->map_base = base;
+  compact->map_len = (size_t)st.st_size;
+
+  return compact;
+}
+
+  /**
+   *  @fn void avl_compact_free(avl_compact *compact)
+   *
+   *  @brief frees all memory allocated to @p compact
+   *
+   *  The values themselves belong to whoever owns the source tree and
+   *  are not touched.
+   *
+   *  @param compact - pointer to existing @a avl_compact
+   *
+   *  @par Returns
+   *       Nothing.
+   */
+
+void avl_compact_free(avl_compact *compact)
+{
+  if (!compact) return;
+
+  if (compact->map_base) munmap(compact->map_base, compact->map_len);
+  else if (compact->owns_nodes) free(compact->nodes);
+  free(compact);
+}
+
+  /*
+   * private functions
+   */
+
+  /**
+   *  @fn int compact_key_cmp(const avl_compact *compact,
+   *                          const void *key,
+   *                          const avl_cnode *node)
+   *
+   *  @brief compare a bare key to a compact node by the key flavor
+   *
+   *  @param compact - pointer to existing @a avl_compact
+   *  @param key - bare key
+   *  @param node - pointer to @a avl_cnode in the array
+   *
+   *  @return negative if key<node, 0 if key==node, positive if key>node
+   */
+
+static int compact_key_cmp(const avl_compact *compact,
+                           const void *key,
+                           const avl_cnode *node)
+{
+  switch (compact->key_kind)
+  {
+    case avl_key_i64:
+    {
+      intptr_t x = (intptr_t)key, y = (intptr_t)node->value;
+      return (x > y) - (x < y);
+    }
+    case avl_key_u64:
+    {
+      uintptr_t x = (uintptr_t)key, y = (uintptr_t)node->value;
+      return (x > y) - (x < y);
+    }
+    case avl_key_str:
+      return strcmp(key, node->value);
+    case avl_key_mem:
+      return memcmp(key, node->value, compact->key_len);
+    default:
+    {
+        /*
+         * cmp_key expects an avl_node; hand it a stack stand-in
+         * carrying the value, which is all key comparators may touch
+         */
+
+      avl_node stand_in;
+      memset(&stand_in, 0, sizeof(stand_in));
+      stand_in.value = node->value;
+      return compact->cmp_key(key, &stand_in);
+    }
+  }
+}
+
+  /**
+   *  @fn unsigned compact_link(avl_cnode *nodes, unsigned lo, unsigned hi)
+   *
+   *  @brief link the slots in nodes[lo..hi) into a height-balanced shape
+   *
+   *  @param nodes - node array, values already in key order
+   *  @param lo - index of first slot in the slice
+   *  @param hi - index one past the last slot in the slice
+   *
+   *  @return index of the slice's root, AVL_COMPACT_NIL for an empty one
+   */
+
+static unsigned compact_link(avl_cnode *nodes, unsigned lo, unsigned hi)
+{
+  unsigned mid;
+
+  if (lo >= hi) return AVL_COMPACT_NIL;
+
+  mid = lo + ((hi - lo) / 2);
+
+  nodes[mid].left = compact_link(nodes, lo, mid);
+  nodes[mid].right = compact_link(nodes, mid + 1, hi);
+
+  return mid;
+}
+
+  /**
+   *  @fn int compact_walk(const avl_compact *compact,
+   *                       unsigned index,
+   *                       int depth,
+   *                       avl_value_action action)
+   *
+   *  @brief in-order walk of the compact sub-tree at @p index
+   *
+   *  Out-of-range indices and over-deep nesting (a cycle in a corrupt
+   *  mapped image) abort the walk instead of running off the mapping.
+   *
+   *  @param compact - pointer to existing @a avl_compact
+   *  @param index - index of sub-tree root, may be AVL_COMPACT_NIL
+   *  @param depth - recursion depth, for corruption containment
+   *  @param action - function that gets called for each value
+   *
+   *  @return non-zero when the walk stopped early
+   */
+
+static int compact_walk(const avl_compact *compact,
+                        unsigned index,
+                        int depth,
+                        avl_value_action action)
+{
+  avl_cnode *node;
+
+  if (index == AVL_COMPACT_NIL) return 0;
+  if ((index >= compact->count) || (depth >= AVL_COMPACT_MAX_DEPTH)) return 1;
+
+  node = &compact->nodes[index];
+
+  if (compact_walk(compact, node->left, depth + 1, action)) return 1;
+  if (action(node->value)) return 1;
+  return compact_walk(compact, node->right, depth + 1, action);
+}
+
+  /**
+   *  @fn int compact_write_all(int fd, const void *data, size_t len)
+   *
+   *  @brief write @p len bytes to @p fd, riding out short writes
+   *
+   *  @param fd - writable file descriptor
+   *  @param data - bytes to write
+   *  @param len - number of bytes
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+static int compact_write_all(int fd, const void *data, size_t len)
+{
+  const char *p = data;
+  ssize_t n;
+
+  while (len)
+  {
+    n = write(fd, p, len);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= (size_t)n;
+  }
+
+  return 0;
+}
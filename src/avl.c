@@ -22,37 +22,281 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "avl.h"
 
-static avl_node *_avl_node_new(void *value);
-static avl_node *_avl_insert(avl_node *node,
-                             avl_node *item,
-                             int (*compare)(avl_node *a, avl_node *b));
-static avl_node *_avl_delete(avl_node *root,
-                             avl_node *target,
-                             int (*compare)(avl_node *a, avl_node *b),
-                             void (*free_node)(avl_node *n));
-static avl_node *_avl_find(avl_node *node,
-                           avl_node *target,
-                           int (*compare)(avl_node *a, avl_node *b));
-static void _avl_destroy(avl_node *root,
-                         int (*compare)(avl_node *a, avl_node *b),
-                         void (*free_node)(avl_node *n));
+  /**
+   *  @def AVL_PREFETCH
+   *  @brief best-effort prefetch of the cache line at @p p
+   *
+   *  Descents issue this on both children before running the
+   *  comparator, so the comparator's work hides the latency of the
+   *  next level's memory access.  Compiles to nothing where the
+   *  builtin is unavailable.
+   */
+
+#ifdef __GNUC__
+#define AVL_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define AVL_PREFETCH(p) ((void)0)
+#endif
+
+  /**
+   *  @def AVL_FIND_LANES
+   *  @brief number of independent descents avl_find_many() keeps in flight
+   */
+
+#define AVL_FIND_LANES 8
+
+  /**
+   *  @def AVL_ARENA_DEFAULT_SLAB
+   *  @brief default number of nodes carved from each arena slab
+   */
+
+#define AVL_ARENA_DEFAULT_SLAB 8192
+
+  /**
+   *  @typedef struct avl_slab avl_slab
+   *  @brief   creates a type for @a avl_slab struct
+   */
+
+typedef struct avl_slab avl_slab;
+
+  /**
+   *  @struct avl_slab
+   *  @brief one contiguous block of nodes belonging to an @a avl_arena
+   */
+
+struct avl_slab
+{
+  avl_slab *next;    /**<  next slab in arena                 */
+  size_t used;       /**<  number of nodes handed out so far  */
+  avl_node nodes[];  /**<  the nodes themselves               */
+};
+
+  /**
+   *  @struct avl_arena
+   *  @brief slab allocator that nodes are carved from, with a freelist of
+   *         recycled nodes
+   */
+
+struct avl_arena
+{
+  avl_slab *slabs;        /**<  list of slabs, newest first          */
+  avl_node *free_list;    /**<  recycled nodes, linked via ->right   */
+  size_t nodes_per_slab;  /**<  number of nodes in each slab         */
+};
+
+  /**
+   *  @def AVL_DUP_MAX_TASKS
+   *  @brief upper bound on the sub-tree clone tasks avl_dup_parallel()
+   *         splits a tree into
+   */
+
+#define AVL_DUP_MAX_TASKS 256
+
+  /**
+   *  @typedef struct dup_task dup_task
+   *  @brief   creates a type for @a dup_task struct
+   */
+
+typedef struct dup_task dup_task;
+
+  /**
+   *  @struct dup_task
+   *  @brief one sub-tree clone job for avl_dup_parallel()
+   */
+
+struct dup_task
+{
+  avl_node *src;     /**<  root of source sub-tree                     */
+  avl_node **dst;    /**<  slot in the copy that receives the clone     */
+  avl_node *parent;  /**<  skeleton node that owns the slot, if any     */
+};
+
+  /**
+   *  @typedef struct walk_worker_args walk_worker_args
+   *  @brief   creates a type for @a walk_worker_args struct
+   */
+
+typedef struct walk_worker_args walk_worker_args;
+
+  /**
+   *  @struct walk_worker_args
+   *  @brief the strided slice of sub-trees one avl_walk_parallel()
+   *         worker traverses
+   */
+
+struct walk_worker_args
+{
+  avl_node **tasks;    /**<  shared array of sub-tree roots  */
+  size_t ntasks;       /**<  total number of sub-trees       */
+  size_t start;        /**<  first task index for this worker  */
+  size_t stride;       /**<  step between task indices        */
+  avl_order order;     /**<  avl_pre_order or avl_post_order  */
+  avl_action action;   /**<  function called on each node     */
+};
+
+  /**
+   *  @typedef struct dup_worker_args dup_worker_args
+   *  @brief   creates a type for @a dup_worker_args struct
+   */
+
+typedef struct dup_worker_args dup_worker_args;
+
+  /**
+   *  @struct dup_worker_args
+   *  @brief the strided slice of clone tasks one worker thread handles
+   */
+
+struct dup_worker_args
+{
+  avl *new_tree;      /**<  tree the clones belong to       */
+  avl *tree;          /**<  source tree                     */
+  dup_task *tasks;    /**<  shared task array               */
+  size_t ntasks;      /**<  total number of tasks           */
+  size_t start;       /**<  first task index for this worker  */
+  size_t stride;      /**<  step between task indices        */
+};
+
+  /**
+   *  @def AVL_SAVE_MAGIC
+   *  @brief magic number opening an avl_save() image
+   */
+
+#define AVL_SAVE_MAGIC 0x31544c41u  /* "ALT1" */
+
+  /**
+   *  @struct avl_save_header
+   *  @brief fixed-size header of an avl_save() image
+   */
+
+struct avl_save_header
+{
+  uint32_t magic;      /**<  AVL_SAVE_MAGIC                   */
+  uint32_t key_kind;   /**<  key flavor of the saved tree     */
+  uint64_t key_len;    /**<  key size for the mem flavor      */
+  uint64_t count;      /**<  number of nodes in the image     */
+};
+
+  /**
+   *  @struct avl_lock
+   *  @brief reader-writer lock backing a tree created with
+   *         avl_new_concurrent()
+   */
+
+struct avl_lock
+{
+  pthread_rwlock_t rw;   /**<  the lock itself  */
+};
+
+static avl_node *_avl_node_new(avl *tree, void *value);
+static void _avl_node_release(avl *tree, avl_node *node);
+static avl_arena *_avl_arena_new(size_t nodes_per_slab);
+static void _avl_arena_free(avl_arena *arena);
+static avl_node *_avl_arena_alloc(avl_arena *arena);
+static void _avl_release_values(avl_node *root, avl_free_node free_node);
+static int _avl_insert(avl *tree,
+                       avl_node **rootp,
+                       avl_node *item,
+                       avl_node **existing);
+static int _avl_insert_topdown(avl *tree,
+                               avl_node **rootp,
+                               avl_node *item,
+                               avl_node **existing);
+static int tree_insert(avl *tree,
+                       avl_node **rootp,
+                       avl_node *item,
+                       avl_node **existing);
+static avl_node *_avl_build_sorted(avl_node **items, size_t lo, size_t hi);
+static void sort_nodes(avl *tree,
+                       avl_node **items,
+                       avl_node **tmp,
+                       size_t n);
+static size_t export_in_order(avl *tree,
+                              avl_node **nodes,
+                              void **values,
+                              size_t cap);
+static avl_node *rebalance_node(avl *tree, avl_node *node);
+static avl_node *join_nodes(avl *tree, avl_node *tl, avl_node *k, avl_node *tr);
+static void split_nodes(avl *tree,
+                        avl_node *root,
+                        avl_node *pivot,
+                        avl_node **lo,
+                        avl_node **hi);
+static avl_node *unlink_last(avl *tree);
+static int _avl_delete(avl *tree,
+                       avl_node **rootp,
+                       avl_node *target,
+                       const void *key);
+static avl_node *_avl_find(avl *tree, avl_node *target);
+static void _avl_destroy(avl *tree);
 static void _avl_walk(avl_node *root, avl_order order, avl_action action);
+static int range_walk(avl *tree,
+                      avl_node *node,
+                      avl_node *lo,
+                      avl_node *hi,
+                      avl_action action);
 static int height(avl_node *n);
+static size_t node_size(avl_node *n);
+static size_t node_mult(avl_node *n);
 static int max(int a, int b);
 static avl_node *avl_rotate_right(avl_node *y);
 static avl_node *avl_rotate_left(avl_node *x);
 static int avl_get_balance(avl_node *n);
-static avl_node *minimum_node(avl_node *n);
-static void pre_order(avl_node *root, avl_action action);
-static void forward_order(avl_node *root, avl_action action);
-static void reverse_order(avl_node *root, avl_action action);
-static void post_order(avl_node *root, avl_action action);
-static void tree_order(avl_node *root, avl_action action);
-static void __tree_order(avl_node *root, avl_action action, int height);
-static void dup_tree(avl *tree, avl_node **new_root, avl_node *old_root);
+static int pre_order(avl_node *root, avl_action action);
+static int forward_order(avl_node *root, avl_action action);
+static int reverse_order(avl_node *root, avl_action action);
+static int post_order(avl_node *root, avl_action action);
+static int tree_order(avl_node *root, avl_action action);
+static void iter_push_spine(avl_iter *iter, avl_node *node);
+static avl_node *dup_tree(avl *new_tree, avl *tree, avl_node *old_root);
+static int dup_collect_tasks(avl *new_tree,
+                             avl *tree,
+                             avl_node *src,
+                             avl_node **dst,
+                             avl_node *parent,
+                             int level,
+                             dup_task *tasks,
+                             size_t *ntasks);
+static void *dup_worker(void *arg);
+static void walk_collect(avl_node *node,
+                         int level,
+                         avl_node **skeleton,
+                         size_t *nskel,
+                         avl_node **tasks,
+                         size_t *ntasks);
+static void *walk_worker(void *arg);
+static void tree_rdlock(avl *tree);
+static void tree_wrlock(avl *tree);
+static void tree_unlock(avl *tree);
+static avl_node *node_private(avl *tree, avl_node **linkp);
+static int write_all(int fd, const void *data, size_t len);
+static int read_all(int fd, void *data, size_t len);
+static int save_value_intrinsic(int fd, void *value);
+static int load_value_intrinsic(int fd, void **value);
+static int save_subtree(avl_node *root, int fd, avl_value_save save_value);
+static avl_node *load_subtree(avl *tree,
+                              int fd,
+                              avl_value_load load_value,
+                              int depth,
+                              int *error);
+static void release_version(avl *tree, avl_node *node);
+static int node_cmp(avl *tree, avl_node *a, avl_node *b);
+static int key_cmp(avl *tree, const void *key, avl_node *n);
+static int tree_has_cmp(const avl *tree);
+static int tree_has_key_cmp(const avl *tree);
+static int cmp_i64_node(avl_node *a, avl_node *b);
+static int cmp_u64_node(avl_node *a, avl_node *b);
+static int cmp_str_node(avl_node *a, avl_node *b);
+static int cmp_i64_key(const void *key, avl_node *n);
+static int cmp_u64_key(const void *key, avl_node *n);
+static int cmp_str_key(const void *key, avl_node *n);
 
     /*
      * public functions
@@ -80,6 +324,195 @@ avl *avl_new(void)
   tree = malloc(sizeof(avl));
   if (tree) memset(tree, 0, sizeof(avl));
 
+  return tree;
+}
+
+  /**
+   *  @fn avl *avl_new_with_arena(size_t nodes_per_slab)
+   *
+   *  @brief Create an avl tree whose nodes are carved from a slab arena
+   *
+   *  Nodes are allocated out of large contiguous slabs instead of one
+   *  malloc per node, and recycled through a freelist on delete.
+   *  avl_free() releases the slabs themselves rather than walking the
+   *  tree node by node.
+   *
+   *  In arena mode a user supplied free_node function is treated as a
+   *  payload release hook: it is called before a node is recycled or the
+   *  arena is torn down, and must NOT free the node itself.  User
+   *  supplied new_node/dup_node functions bypass the arena entirely and
+   *  should not be combined with it; nodes they allocate are never
+   *  reclaimed by avl_free().
+   *
+   *  @param nodes_per_slab - number of nodes per slab, 0 for the default
+   *
+   *  @return pointer to new @a avl struct
+   */
+
+avl *avl_new_with_arena(size_t nodes_per_slab)
+{
+  avl *tree = NULL;
+
+  tree = avl_new();
+  if (!tree) goto exit;
+
+  tree->arena = _avl_arena_new(nodes_per_slab);
+  if (!tree->arena)
+  {
+    free(tree);
+    tree = NULL;
+  }
+
+exit:
+  return tree;
+}
+
+  /**
+   *  @fn avl *avl_new_concurrent(void)
+   *
+   *  @brief Create an avl tree safe for concurrent readers
+   *
+   *  The tree carries a reader-writer lock: find, walk, count and
+   *  order-statistics queries run concurrently with each other, while
+   *  insert and delete are serialized among themselves and against all
+   *  readers.  A cursor opened with avl_iter_begin() holds the read
+   *  lock until avl_iter_end() is called, so batches stream against a
+   *  stable tree.
+   *
+   *  @par Parameters
+   *       None.
+   *
+   *  @return pointer to new @a avl struct
+   */
+
+avl *avl_new_concurrent(void)
+{
+  avl *tree = NULL;
+
+  tree = avl_new();
+  if (!tree) goto exit;
+
+  tree->lock = malloc(sizeof(avl_lock));
+  if (!tree->lock || pthread_rwlock_init(&tree->lock->rw, NULL))
+  {
+    free(tree->lock);
+    free(tree);
+    tree = NULL;
+  }
+
+exit:
+  return tree;
+}
+
+  /**
+   *  @fn avl *avl_new_i64(void)
+   *
+   *  @brief Create an avl tree keyed by signed integers stored in @a value
+   *
+   *  The descent loops of find, insert and delete compare the coerced
+   *  integer keys inline, with no indirect comparator call per level.
+   *  Matching cmp_node/cmp_key functions are installed for the generic
+   *  entry points; calling avl_set_cmp() later returns the tree to the
+   *  generic flavor.
+   *
+   *  @par Parameters
+   *       None.
+   *
+   *  @return pointer to new @a avl struct
+   */
+
+avl *avl_new_i64(void)
+{
+  avl *tree = avl_new();
+
+  if (!tree) return NULL;
+
+  tree->key_kind = avl_key_i64;
+  tree->cmp_node = cmp_i64_node;
+  tree->cmp_key = cmp_i64_key;
+
+  return tree;
+}
+
+  /**
+   *  @fn avl *avl_new_u64(void)
+   *
+   *  @brief Create an avl tree keyed by unsigned integers stored in @a value
+   *
+   *  See avl_new_i64() for the inline-comparison behavior.
+   *
+   *  @par Parameters
+   *       None.
+   *
+   *  @return pointer to new @a avl struct
+   */
+
+avl *avl_new_u64(void)
+{
+  avl *tree = avl_new();
+
+  if (!tree) return NULL;
+
+  tree->key_kind = avl_key_u64;
+  tree->cmp_node = cmp_u64_node;
+  tree->cmp_key = cmp_u64_key;
+
+  return tree;
+}
+
+  /**
+   *  @fn avl *avl_new_str(void)
+   *
+   *  @brief Create an avl tree keyed by NUL-terminated strings in @a value
+   *
+   *  See avl_new_i64() for the inline-comparison behavior.
+   *
+   *  @par Parameters
+   *       None.
+   *
+   *  @return pointer to new @a avl struct
+   */
+
+avl *avl_new_str(void)
+{
+  avl *tree = avl_new();
+
+  if (!tree) return NULL;
+
+  tree->key_kind = avl_key_str;
+  tree->cmp_node = cmp_str_node;
+  tree->cmp_key = cmp_str_key;
+
+  return tree;
+}
+
+  /**
+   *  @fn avl *avl_new_memcmp(size_t len)
+   *
+   *  @brief Create an avl tree keyed by fixed-size byte keys in @a value
+   *
+   *  See avl_new_i64() for the inline-comparison behavior.  Generic
+   *  cmp_node/cmp_key slots are not installed for this flavor (they
+   *  would need the key length); the library's own entry points carry
+   *  the tree and compare inline.
+   *
+   *  @param len - key size in bytes
+   *
+   *  @return pointer to new @a avl struct
+   */
+
+avl *avl_new_memcmp(size_t len)
+{
+  avl *tree;
+
+  if (!len) return NULL;
+
+  tree = avl_new();
+  if (!tree) return NULL;
+
+  tree->key_kind = avl_key_mem;
+  tree->key_len = len;
+
   return tree;
 }
 
@@ -105,940 +538,4796 @@ avl *avl_dup(avl *tree)
   memcpy(new_tree, tree, sizeof(avl));
   new_tree->root = NULL;
   new_tree->height = 0;
+  new_tree->arena = NULL;
+  new_tree->lock = NULL;
+  new_tree->persistent = 0;
+  new_tree->frozen = 0;
+  new_tree->recycle_list = NULL;
+  new_tree->recycle_count = 0;
+
+  if (tree->arena)
+  {
+    new_tree->arena = _avl_arena_new(tree->arena->nodes_per_slab);
+    if (!new_tree->arena)
+    {
+      free(new_tree);
+      new_tree = NULL;
+      goto exit;
+    }
+  }
+
+  if (tree->lock)
+  {
+    new_tree->lock = malloc(sizeof(avl_lock));
+    if (!new_tree->lock || pthread_rwlock_init(&new_tree->lock->rw, NULL))
+    {
+      free(new_tree->lock);
+      _avl_arena_free(new_tree->arena);
+      free(new_tree);
+      new_tree = NULL;
+      goto exit;
+    }
+  }
 
-  dup_tree(tree, &new_tree->root, tree->root);
+  tree_rdlock(tree);
+  new_tree->root = dup_tree(new_tree, tree, tree->root);
+  new_tree->height = height(new_tree->root);
+  tree_unlock(tree);
 
 exit:
   return new_tree;
 }
 
   /**
-   *  @fn void avl_free(avl *tree)
+   *  @fn avl *avl_dup_parallel(avl *tree, int nthreads)
    *
-   *  @brief frees all memory allocated to @p tree
+   *  @brief Creates deep copy of @p tree using up to @p nthreads threads
+   *
+   *  The top of the tree is cloned sequentially down to a frontier of
+   *  sub-trees, which are then cloned concurrently by worker threads;
+   *  balanced AVL structure makes the sub-trees similar in size.  User
+   *  supplied dup_node/new_node functions must be thread-safe.  Arena
+   *  trees fall back to the sequential avl_dup(), since arena
+   *  allocation is single-threaded.
    *
    *  @param tree - pointer to existing AVL tree
+   *  @param nthreads - number of worker threads to use
    *
-   *  @par Returns
-   *       Nothing.
+   *  @return pointer to new @a avl struct
    */
 
-void avl_free(avl *tree)
+avl *avl_dup_parallel(avl *tree, int nthreads)
 {
-  if (!tree) return;
+  avl *new_tree = NULL;
+  dup_task tasks[AVL_DUP_MAX_TASKS];
+  size_t ntasks = 0;
+  pthread_t threads[AVL_DUP_MAX_TASKS];
+  dup_worker_args args[AVL_DUP_MAX_TASKS];
+  int level;
+  size_t nworkers, i, started;
 
-  if (tree->root) _avl_destroy(tree->root, tree->cmp_node, tree->free_node);
-  free(tree);
-}
+  if (!tree) goto exit;
 
-  /**
-   *  @fn int avl_insert(avl *tree, avl_node *item)
-   *
-   *  @brief inserts @p item into @p tree
-   *
-   *  @param tree - pointer to existing AVL tree
-   *  @param item - pointer to AVL NODE to insert
-   *
-   *  @return 0 on success, -1 on failure
-   */
+  if ((nthreads <= 1) || tree->arena || !tree->root) return avl_dup(tree);
 
-int avl_insert(avl *tree, avl_node *item)
-{
-  int rv = -1;
-  avl_node *new_root;
+  if (nthreads > AVL_DUP_MAX_TASKS) nthreads = AVL_DUP_MAX_TASKS;
 
-  if (!tree || !item) goto exit;
+  new_tree = malloc(sizeof(avl));
+  if (!new_tree) goto exit;
 
-  new_root = _avl_insert(tree->root, item, tree->cmp_node);
-  if (new_root)
+  memcpy(new_tree, tree, sizeof(avl));
+  new_tree->root = NULL;
+  new_tree->height = 0;
+  new_tree->arena = NULL;
+  new_tree->lock = NULL;
+  new_tree->persistent = 0;
+  new_tree->frozen = 0;
+  new_tree->recycle_list = NULL;
+  new_tree->recycle_count = 0;
+
+  if (tree->lock)
   {
-    tree->root = new_root;
-    tree->height = height(tree->root);
-    rv = 0;
+    new_tree->lock = malloc(sizeof(avl_lock));
+    if (!new_tree->lock || pthread_rwlock_init(&new_tree->lock->rw, NULL))
+    {
+      free(new_tree->lock);
+      free(new_tree);
+      new_tree = NULL;
+      goto exit;
+    }
   }
 
+  tree_rdlock(tree);
+
+    /*
+     * clone the top levels sequentially, queueing the sub-trees below
+     * them as tasks; aim for several tasks per thread so uneven
+     * sub-tree sizes even out
+     */
+
+  level = 1;
+  while (((1 << level) < (nthreads * 4))
+         && ((1 << (level + 1)) <= AVL_DUP_MAX_TASKS))
+    level++;
+
+  if (dup_collect_tasks(new_tree, tree, tree->root, &new_tree->root,
+                        NULL, level, tasks, &ntasks))
+  {
+    tree_unlock(tree);
+    avl_free(new_tree);
+    new_tree = NULL;
+    goto exit;
+  }
+
+  nworkers = ((size_t)nthreads < ntasks) ? (size_t)nthreads : ntasks;
+
+  for (i = 0; i < nworkers; i++)
+  {
+    args[i].new_tree = new_tree;
+    args[i].tree = tree;
+    args[i].tasks = tasks;
+    args[i].ntasks = ntasks;
+    args[i].start = i;
+    args[i].stride = nworkers;
+  }
+
+  started = 0;
+  for (i = 0; i < nworkers; i++)
+  {
+    if (pthread_create(&threads[i], NULL, dup_worker, &args[i])) break;
+    started++;
+  }
+
+    /*
+     * any tasks whose worker never started are cloned right here
+     */
+
+  for (i = started; i < nworkers; i++) dup_worker(&args[i]);
+
+  for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+  tree_unlock(tree);
+
+  new_tree->height = height(new_tree->root);
+
 exit:
-  return rv;
+  return new_tree;
 }
 
   /**
-   *  @fn int avl_delete(avl *tree, avl_node *target)
+   *  @fn avl *avl_snapshot(avl *tree)
    *
-   *  @brief deletes @p item from @p tree
+   *  @brief take an O(1) frozen snapshot of @p tree
+   *
+   *  The snapshot handle shares the tree's nodes; both trees become
+   *  persistent, so later avl_insert()/avl_delete() on the live tree
+   *  copy only the O(log n) nodes on the modified path and everything
+   *  else stays shared.  Mutations on the snapshot itself are refused.
+   *  Freeing either tree releases only the nodes no other version still
+   *  references.
+   *
+   *  Because node payloads are shared between versions, a free_node
+   *  function set on persistent trees must tolerate being called once
+   *  per node copy that shares a payload (e.g. refcount the payloads),
+   *  or be left unset.  Arena trees cannot be snapshotted: their nodes
+   *  are reclaimed wholesale with the slabs.
    *
    *  @param tree - pointer to existing AVL tree
-   *  @param target - pointer to AVL NODE to delete
    *
-   *  @return 0 on success, -1 on failure
+   *  @return pointer to new frozen @a avl struct, or NULL on failure
    */
 
-int avl_delete(avl *tree, avl_node *target)
+avl *avl_snapshot(avl *tree)
 {
-  int rv = -1;
-  avl_node *new_root;
+  avl *snap = NULL;
 
-  if (!tree || !target) goto exit;
+  if (!tree || tree->arena) goto exit;
+
+  snap = malloc(sizeof(avl));
+  if (!snap) goto exit;
+
+  tree_wrlock(tree);
+
+    /*
+     * the refcount saturation check reads the root, so it must sit
+     * inside the lock - a concurrent writer may be replacing it
+     */
+
+  if (tree->root && (tree->root->refs >= USHRT_MAX))
+  {
+    tree_unlock(tree);
+    free(snap);
+    snap = NULL;
+    goto exit;
+  }
+
+  memcpy(snap, tree, sizeof(avl));
+  snap->lock = NULL;
+  snap->persistent = 1;
+  snap->frozen = 1;
+  snap->recycle_list = NULL;
+  snap->recycle_count = 0;
+  snap->recycle_limit = 0;
+
+  tree->persistent = 1;
+  if (tree->root) tree->root->refs++;
+
+  tree_unlock(tree);
+
+exit:
+  return snap;
+}
+
+  /**
+   *  @fn void avl_free(avl *tree)
+   *
+   *  @brief frees all memory allocated to @p tree
+   *
+   *  @param tree - pointer to existing AVL tree
+   *
+   *  @par Returns
+   *       Nothing.
+   */
+
+void avl_free(avl *tree)
+{
+  if (!tree) return;
+
+  if (tree->persistent)
+  {
+      /*
+       * drop this version's references; sub-trees still shared with
+       * other snapshots survive until their last reference goes
+       */
+
+    release_version(tree, tree->root);
+  }
+  else if (tree->arena)
+  {
+      /*
+       * whole-tree teardown is a handful of slab frees; the tree is only
+       * walked if the user needs a payload release hook called
+       */
+
+    if (tree->root && tree->free_node)
+      _avl_release_values(tree->root, tree->free_node);
+    _avl_arena_free(tree->arena);
+  }
+  else if (tree->root) _avl_destroy(tree);
+
+  while (tree->recycle_list)
+  {
+    avl_node *next = tree->recycle_list->right;
+
+    free(tree->recycle_list);
+    tree->recycle_list = next;
+  }
+
+  if (tree->lock)
+  {
+    pthread_rwlock_destroy(&tree->lock->rw);
+    free(tree->lock);
+  }
+
+  free(tree);
+}
+
+  /**
+   *  @fn int avl_insert(avl *tree, avl_node *item)
+   *
+   *  @brief inserts @p item into @p tree
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param item - pointer to AVL NODE to insert
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_insert(avl *tree, avl_node *item)
+{
+  int rv = -1;
+  int res;
+
+  if (!tree || !item || tree->frozen) goto exit;
+
+  tree_wrlock(tree);
+  res = tree_insert(tree, &tree->root, item, NULL);
+  if (res >= 0)
+  {
+    if ((res == 1) && tree->multi) _avl_node_release(tree, item);
+    tree->height = height(tree->root);
+    rv = 0;
+  }
+  tree_unlock(tree);
+
+exit:
+  return rv;
+}
+
+  /**
+   *  @fn int avl_insert_value(avl *tree, void *value)
+   *
+   *  @brief creates a node for @p value and inserts it into @p tree
+   *
+   *  Key-direct companion to avl_insert() for callers that do not want
+   *  to manage nodes themselves.  When the key is already present the
+   *  new node is released again and the tree is unchanged.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param value - pointer to payload that is attached to the node
+   *
+   *  @return 0 on success, 1 when the key was already present, -1 on failure
+   */
+
+int avl_insert_value(avl *tree, void *value)
+{
+  int rv = -1;
+  int res;
+  avl_node *node, *existing;
+
+  if (!tree || tree->frozen) goto exit;
+
+  tree_wrlock(tree);
+
+  node = avl_node_new(tree, value);
+  if (!node)
+  {
+    tree_unlock(tree);
+    goto exit;
+  }
+
+  res = tree_insert(tree, &tree->root, node, &existing);
+  if (res < 0)
+  {
+    _avl_node_release(tree, node);
+    tree_unlock(tree);
+    goto exit;
+  }
+
+  tree->height = height(tree->root);
+
+  if (existing)
+  {
+    _avl_node_release(tree, node);
+    rv = 1;
+  }
+  else rv = 0;
+
+  tree_unlock(tree);
+
+exit:
+  return rv;
+}
+
+  /**
+   *  @fn avl_node *avl_find_or_insert(avl *tree, avl_node *item, int *inserted)
+   *
+   *  @brief find @p item's key in @p tree, inserting @p item on a miss
+   *
+   *  One descent instead of the avl_find()-then-avl_insert() dance: the
+   *  insert engine either attaches @p item (returning it, with
+   *  @p inserted set) or stops at the already-present node and returns
+   *  that.  On a match the caller keeps ownership of @p item.  On a
+   *  multiset tree a match additionally counts one more occurrence of
+   *  the key, exactly as avl_insert() would.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param item - pointer to AVL NODE to insert on a miss
+   *  @param inserted - when non-NULL, set to 1 if @p item was inserted,
+   *                    0 otherwise
+   *
+   *  @return the resident node (either @p item or the pre-existing
+   *          match), NULL on failure
+   */
+
+avl_node *avl_find_or_insert(avl *tree, avl_node *item, int *inserted)
+{
+  avl_node *node = NULL, *existing;
+  int res;
+
+  if (inserted) *inserted = 0;
+
+  if (!tree || !item || tree->frozen) goto exit;
+
+  tree_wrlock(tree);
+
+  res = tree_insert(tree, &tree->root, item, &existing);
+
+  if (res == 0)
+  {
+    tree->height = height(tree->root);
+    node = item;
+    if (inserted) *inserted = 1;
+  }
+  else if (res == 1) node = existing;
+
+  tree_unlock(tree);
+
+exit:
+  return node;
+}
 
-  new_root = _avl_delete(tree->root, target, tree->cmp_node, tree->free_node);
-  if (new_root)
+  /**
+   *  @fn int avl_insert_batch(avl *tree, avl_node **items, size_t n)
+   *
+   *  @brief inserts a batch of nodes into @p tree in one operation
+   *
+   *  The batch is sorted with the tree's comparator first.  A batch
+   *  that is large relative to the tree (a quarter of its size or more)
+   *  is merged with the tree's own nodes in one in-order pass and the
+   *  result relinked with the O(n) bulk builder - amortized cost well
+   *  under one root-to-leaf descent per item, and sequential memory
+   *  access instead of n cold descents.  Smaller batches go through the
+   *  normal insert engine one by one, still saving the caller the sort.
+   *
+   *  Duplicate keys - within the batch or against the tree - are
+   *  released through the tree's node release path, like the duplicate
+   *  case of avl_insert_value().  Trees with live snapshots always use
+   *  the per-item engine, since the merge path relinks nodes in place.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param items - array of @p n nodes to insert
+   *  @param n - number of nodes in @p items
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_insert_batch(avl *tree, avl_node **items, size_t n)
+{
+  int rv = -1;
+  avl_node **tmp, **all, **out, *candidate;
+  size_t count, i, j, o;
+  int pos;
+
+  if (!tree || (n && !items) || tree->frozen) goto exit;
+  if (!n) return 0;
+  if (!tree_has_cmp(tree)) goto exit;
+  if ((n >= UINT_MAX) || (node_size(tree->root) + n >= UINT_MAX)) goto exit;
+
+  tmp = malloc(n * sizeof(avl_node *));
+  if (!tmp) goto exit;
+
+  sort_nodes(tree, items, tmp, n);
+  free(tmp);
+
+  tree_wrlock(tree);
+
+  count = node_size(tree->root);
+
+  if (tree->persistent || tree->multi || ((n * 4) < count))
   {
-    tree->root = new_root;
+      /*
+       * small batch: one descent per item; sorted order keeps the
+       * touched paths warm between inserts
+       */
+
+    for (i = 0; i < n; i++)
+    {
+      pos = tree_insert(tree, &tree->root, items[i], NULL);
+      if (pos > 0) _avl_node_release(tree, items[i]);
+      if (pos < 0)
+      {
+        tree_unlock(tree);
+        goto exit;
+      }
+    }
+
     tree->height = height(tree->root);
+    tree_unlock(tree);
     rv = 0;
+    goto exit;
+  }
+
+    /*
+     * large batch: flatten the tree in-order, merge with the sorted
+     * batch, and relink everything with the bulk builder
+     */
+
+  all = malloc(count * sizeof(avl_node *));
+  out = malloc((count + n) * sizeof(avl_node *));
+  if (!all || !out)
+  {
+    free(all);
+    free(out);
+    tree_unlock(tree);
+    goto exit;
+  }
+
+  export_in_order(tree, all, NULL, count);
+
+  i = 0;
+  j = 0;
+  o = 0;
+
+  while ((i < count) || (j < n))
+  {
+    candidate = NULL;
+
+    if (j >= n) out[o++] = all[i++];
+    else if (i >= count) candidate = items[j++];
+    else
+    {
+      pos = node_cmp(tree, items[j], all[i]);
+      if (pos > 0) out[o++] = all[i++];
+      else if (pos < 0) candidate = items[j++];
+      else
+      {
+          /*
+           * batch key already in the tree: the tree node wins
+           */
+
+        _avl_node_release(tree, items[j]);
+        j++;
+      }
+    }
+
+    if (candidate)
+    {
+        /*
+         * drops duplicates within the batch too, since equal batch
+         * keys arrive back to back after the sort
+         */
+
+      if (o && (node_cmp(tree, candidate, out[o - 1]) == 0))
+        _avl_node_release(tree, candidate);
+      else out[o++] = candidate;
+    }
+  }
+
+  tree->root = _avl_build_sorted(out, 0, o);
+  if (tree->root) tree->root->parent = NULL;
+  tree->height = height(tree->root);
+
+  free(all);
+  free(out);
+
+  tree_unlock(tree);
+  rv = 0;
+
+exit:
+  return rv;
+}
+
+  /**
+   *  @fn int avl_build_sorted(avl *tree, avl_node **items, size_t n)
+   *
+   *  @brief bulk-load @p tree from an array of nodes in ascending key order
+   *
+   *  Builds a height-balanced tree directly by recursive midpoint
+   *  splitting: O(n), no comparator calls, no rotations.  The caller
+   *  guarantees that @p items is sorted ascending by the tree's key
+   *  order with no duplicate keys; the tree must be empty.
+   *
+   *  @param tree - pointer to existing, empty AVL tree
+   *  @param items - array of @p n nodes, sorted ascending by key
+   *  @param n - number of nodes in @p items
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_build_sorted(avl *tree, avl_node **items, size_t n)
+{
+  int rv = -1;
+
+  if (!tree || (n && !items) || tree->frozen) goto exit;
+  if (n >= UINT_MAX) goto exit;
+
+  tree_wrlock(tree);
+  if (tree->root)
+  {
+    tree_unlock(tree);
+    goto exit;
+  }
+
+  tree->root = _avl_build_sorted(items, 0, n);
+  if (tree->root) tree->root->parent = NULL;
+  tree->height = height(tree->root);
+  rv = 0;
+  tree_unlock(tree);
+
+exit:
+  return rv;
+}
+
+  /**
+   *  @fn int avl_delete(avl *tree, avl_node *target)
+   *
+   *  @brief deletes @p item from @p tree
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param target - pointer to AVL NODE to delete
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_delete(avl *tree, avl_node *target)
+{
+  int rv = -1;
+
+  if (!tree || !target || tree->frozen) goto exit;
+
+  tree_wrlock(tree);
+  rv = _avl_delete(tree, &tree->root, target, NULL);
+  if (!rv) tree->height = height(tree->root);
+  tree_unlock(tree);
+
+exit:
+  return rv;
+}
+
+  /**
+   *  @fn int avl_delete_key(avl *tree, const void *key)
+   *
+   *  @brief deletes the node matching @p key from @p tree
+   *
+   *  Key-direct variant of avl_delete() driven by the tree's cmp_key
+   *  function; no throwaway target node is needed.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param key - bare key to delete
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_delete_key(avl *tree, const void *key)
+{
+  int rv = -1;
+
+  if (!tree || tree->frozen) goto exit;
+
+  tree_wrlock(tree);
+  rv = _avl_delete(tree, &tree->root, NULL, key);
+  if (!rv) tree->height = height(tree->root);
+  tree_unlock(tree);
+
+exit:
+  return rv;
+}
+
+  /**
+   *  @fn int avl_join(avl *left, avl *right)
+   *
+   *  @brief concatenate two key-disjoint trees in O(log n)
+   *
+   *  Every key in @p right must be greater than every key in @p left
+   *  (checked against the boundary nodes; overlapping trees are
+   *  refused).  All nodes move into @p left by the standard
+   *  height-aware AVL join - no per-node reinsertion - and @p right is
+   *  left empty but still a valid handle.  Arena trees and trees with
+   *  live snapshots are refused, since their nodes cannot change owner
+   *  or be relinked in place; multiset trees are refused as well, since
+   *  the join's rebalancing cannot carry occurrence counts across the
+   *  relink.
+   *
+   *  @param left - pointer to existing AVL tree receiving all nodes
+   *  @param right - pointer to existing AVL tree with the greater keys
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_join(avl *left, avl *right)
+{
+  int rv = -1;
+  avl_node *k;
+
+  if (!left || !right || (left == right)) goto exit;
+  if (left->frozen || right->frozen) goto exit;
+  if (left->persistent || right->persistent) goto exit;
+  if (left->arena || right->arena) goto exit;
+  if (left->multi || right->multi) goto exit;
+  if (!tree_has_cmp(left)) goto exit;
+
+    /*
+     * consistent address order avoids deadlock when two threads join
+     * the same pair of concurrent trees from opposite ends
+     */
+
+  tree_wrlock(left < right ? left : right);
+  tree_wrlock(left < right ? right : left);
+
+  if (!right->root)
+  {
+    rv = 0;
+    goto unlock;
+  }
+
+  if (!left->root)
+  {
+    left->root = right->root;
+    left->height = right->height;
+    right->root = NULL;
+    right->height = 0;
+    rv = 0;
+    goto unlock;
+  }
+
+    /*
+     * boundary check: the largest left key must sort below the
+     * smallest right key
+     */
+
+  {
+    avl_node *lmax = left->root, *rmin = right->root;
+
+    while (lmax->right) lmax = lmax->right;
+    while (rmin->left) rmin = rmin->left;
+    if (node_cmp(left, lmax, rmin) >= 0) goto unlock;
+  }
+
+    /*
+     * the largest left node becomes the join middle
+     */
+
+  k = unlink_last(left);
+
+  left->root = join_nodes(left, left->root, k, right->root);
+  left->root->parent = NULL;
+  left->height = height(left->root);
+
+  right->root = NULL;
+  right->height = 0;
+  rv = 0;
+
+unlock:
+  tree_unlock(left < right ? right : left);
+  tree_unlock(left < right ? left : right);
+
+exit:
+  return rv;
+}
+
+  /**
+   *  @fn int avl_split(avl *tree, avl_node *pivot, avl **lo, avl **hi)
+   *
+   *  @brief split a tree around a pivot key in O(log n)
+   *
+   *  Nodes with keys below the pivot end up in a new tree at @p lo,
+   *  nodes at-or-above it in a new tree at @p hi; both inherit the
+   *  source's comparators and callbacks.  @p tree itself is left empty
+   *  but remains a valid handle.  The same arena/snapshot/multiset
+   *  restrictions as avl_join() apply.
+   *
+   *  @param tree - pointer to existing AVL tree, consumed by the split
+   *  @param pivot - pointer to AVL NODE carrying the split key
+   *  @param lo - receives the tree of keys below the pivot
+   *  @param hi - receives the tree of keys at-or-above the pivot
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_split(avl *tree, avl_node *pivot, avl **lo, avl **hi)
+{
+  int rv = -1;
+  avl *lo_tree = NULL, *hi_tree = NULL;
+
+  if (!tree || !pivot || !lo || !hi) goto exit;
+  if (tree->frozen || tree->persistent || tree->arena || tree->multi)
+    goto exit;
+  if (!tree_has_cmp(tree)) goto exit;
+
+  lo_tree = malloc(sizeof(avl));
+  hi_tree = malloc(sizeof(avl));
+  if (!lo_tree || !hi_tree)
+  {
+    free(lo_tree);
+    free(hi_tree);
+    goto exit;
+  }
+
+  tree_wrlock(tree);
+
+  memcpy(lo_tree, tree, sizeof(avl));
+  memcpy(hi_tree, tree, sizeof(avl));
+  lo_tree->lock = NULL;
+  hi_tree->lock = NULL;
+  lo_tree->recycle_list = NULL;
+  lo_tree->recycle_count = 0;
+  hi_tree->recycle_list = NULL;
+  hi_tree->recycle_count = 0;
+
+  split_nodes(tree, tree->root, pivot, &lo_tree->root, &hi_tree->root);
+
+  if (lo_tree->root) lo_tree->root->parent = NULL;
+  if (hi_tree->root) hi_tree->root->parent = NULL;
+  lo_tree->height = height(lo_tree->root);
+  hi_tree->height = height(hi_tree->root);
+
+  tree->root = NULL;
+  tree->height = 0;
+
+  tree_unlock(tree);
+
+  *lo = lo_tree;
+  *hi = hi_tree;
+  rv = 0;
+
+exit:
+  return rv;
+}
+
+  /**
+   *  @fn int avl_save(avl *tree, int fd, avl_value_save save_value)
+   *
+   *  @brief write a binary image of @p tree to @p fd
+   *
+   *  The image is a pre-order dump with child-presence flags, so
+   *  avl_load() rebuilds the exact shape with no comparator calls and
+   *  no rebalancing.  @p save_value serializes each node value; when it
+   *  is NULL the value pointer itself is written as a 64-bit integer,
+   *  which suits the intrinsic key flavors.  Multiset trees are
+   *  refused: the image carries one record per distinct node and has
+   *  no field for occurrence counts, so a round trip would lose them.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param fd - writable file descriptor
+   *  @param save_value - value serializer, or NULL for intrinsic values
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_save(avl *tree, int fd, avl_value_save save_value)
+{
+  struct avl_save_header header;
+  int rv = -1;
+
+  if (!tree || (fd < 0) || tree->multi) goto exit;
+
+  if (!save_value) save_value = save_value_intrinsic;
+
+  tree_rdlock(tree);
+
+  memset(&header, 0, sizeof(header));
+  header.magic = AVL_SAVE_MAGIC;
+  header.key_kind = (uint32_t)tree->key_kind;
+  header.key_len = tree->key_len;
+  header.count = node_size(tree->root);
+
+  if (!write_all(fd, &header, sizeof(header)))
+    rv = save_subtree(tree->root, fd, save_value) ? -1 : 0;
+
+  tree_unlock(tree);
+
+exit:
+  return rv;
+}
+
+  /**
+   *  @fn avl *avl_load(int fd, avl_value_load load_value)
+   *
+   *  @brief rebuild a tree from an avl_save() image on @p fd
+   *
+   *  Structure and heights come straight from the pre-order image: no
+   *  comparator calls, no rotations.  The loaded tree carries the saved
+   *  key flavor; a tree saved with custom comparators needs
+   *  avl_set_cmp()/avl_set_cmp_key() called on the result before use.
+   *  @p load_value deserializes each node value; when it is NULL the
+   *  64-bit intrinsic encoding of avl_save() is assumed.
+   *
+   *  @param fd - readable file descriptor positioned at the image
+   *  @param load_value - value deserializer, or NULL for intrinsic values
+   *
+   *  @return pointer to new @a avl struct, or NULL on failure
+   */
+
+avl *avl_load(int fd, avl_value_load load_value)
+{
+  struct avl_save_header header;
+  avl *tree = NULL;
+  int error = 0;
+
+  if (fd < 0) goto exit;
+
+  if (!load_value) load_value = load_value_intrinsic;
+
+  if (read_all(fd, &header, sizeof(header))) goto exit;
+  if (header.magic != AVL_SAVE_MAGIC) goto exit;
+
+  tree = avl_new();
+  if (!tree) goto exit;
+
+  tree->key_kind = (avl_key_kind)header.key_kind;
+  tree->key_len = (size_t)header.key_len;
+
+  switch (tree->key_kind)
+  {
+    case avl_key_i64:
+      tree->cmp_node = cmp_i64_node;
+      tree->cmp_key = cmp_i64_key;
+      break;
+    case avl_key_u64:
+      tree->cmp_node = cmp_u64_node;
+      tree->cmp_key = cmp_u64_key;
+      break;
+    case avl_key_str:
+      tree->cmp_node = cmp_str_node;
+      tree->cmp_key = cmp_str_key;
+      break;
+    default:
+      break;
+  }
+
+  if (header.count)
+  {
+    tree->root = load_subtree(tree, fd, load_value, 0, &error);
+    if (error || (node_size(tree->root) != header.count))
+    {
+      avl_free(tree);
+      tree = NULL;
+      goto exit;
+    }
+    tree->height = height(tree->root);
+  }
+
+exit:
+  return tree;
+}
+
+  /**
+   *  @fn avl_node *avl_find(avl *tree, avl_node *target)
+   *
+   *  @brief searches @p tree for @p target
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param target - pointer to AVL NODE to search for
+   *
+   *  @return pointer to @a avl_node on success, NULL on failure
+   */
+
+avl_node *avl_find(avl *tree, avl_node *target)
+{
+  avl_node *node = NULL;
+
+  if (!tree || !target) goto exit;
+
+  tree_rdlock(tree);
+  node = _avl_find(tree, target);
+  tree_unlock(tree);
+
+exit:
+  return node;
+}
+
+  /**
+   *  @fn avl_node *avl_find_key(avl *tree, const void *key)
+   *
+   *  @brief searches @p tree for the node matching @p key
+   *
+   *  Key-direct variant of avl_find() driven by the tree's cmp_key
+   *  function; no throwaway target node is needed.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param key - bare key to search for
+   *
+   *  @return pointer to @a avl_node on success, NULL on failure
+   */
+
+avl_node *avl_find_key(avl *tree, const void *key)
+{
+  avl_node *node = NULL;
+  size_t depth = 0;
+  int pos;
+
+  if (!tree || !tree_has_key_cmp(tree)) goto exit;
+
+  tree_rdlock(tree);
+  node = tree->root;
+  while (node)
+  {
+    AVL_PREFETCH(node->left);
+    AVL_PREFETCH(node->right);
+    depth++;
+    pos = key_cmp(tree, key, node);
+    if (pos == 0) break;
+    node = (pos < 0) ? node->left : node->right;
+  }
+  if (tree->stats_on && !tree->lock)
+  {
+    tree->stats.finds++;
+    tree->stats.find_depth_total += depth;
+    if (depth > tree->stats.find_depth_max)
+      tree->stats.find_depth_max = depth;
+  }
+  tree_unlock(tree);
+
+exit:
+  return node;
+}
+
+  /**
+   *  @fn size_t avl_find_many(avl *tree,
+   *                           avl_node **targets,
+   *                           avl_node **results,
+   *                           size_t n)
+   *
+   *  @brief look up a batch of targets with interleaved descents
+   *
+   *  A serial descent stalls on one cache miss per level.  This engine
+   *  keeps several independent descents in flight, advancing each one
+   *  level per round and prefetching its next node's children, so
+   *  multiple misses resolve in parallel instead of back to back.
+   *  Results line up with targets: the matching node, or NULL.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param targets - array of @p n AVL NODEs carrying the search keys
+   *  @param results - array of @p n result slots
+   *  @param n - number of lookups
+   *
+   *  @return number of targets found
+   */
+
+size_t avl_find_many(avl *tree, avl_node **targets, avl_node **results,
+                     size_t n)
+{
+  struct
+  {
+    avl_node *node;   /* current position of this descent  */
+    size_t idx;       /* which target it serves            */
+  } lanes[AVL_FIND_LANES];
+  size_t found = 0, next = 0, active = 0, i;
+  avl_node *node, *step;
+  int pos;
+
+  if (!tree || !targets || !results || !tree_has_cmp(tree)) return 0;
+
+  for (i = 0; i < n; i++) results[i] = NULL;
+
+  tree_rdlock(tree);
+
+  if (!tree->root)
+  {
+    tree_unlock(tree);
+    return 0;
+  }
+
+  while (active || (next < n))
+  {
+      /*
+       * refill empty lanes from the remaining targets
+       */
+
+    while ((active < AVL_FIND_LANES) && (next < n))
+    {
+      lanes[active].node = tree->root;
+      lanes[active].idx = next++;
+      active++;
+    }
+
+      /*
+       * advance every lane one level; a finished lane is swapped out
+       * and refilled on the next round
+       */
+
+    for (i = 0; i < active; )
+    {
+      node = lanes[i].node;
+      pos = node_cmp(tree, targets[lanes[i].idx], node);
+
+      if (pos == 0)
+      {
+        results[lanes[i].idx] = node;
+        found++;
+        step = NULL;
+      }
+      else step = (pos < 0) ? node->left : node->right;
+
+      if (!step)
+      {
+        lanes[i] = lanes[--active];
+        continue;
+      }
+
+      AVL_PREFETCH(step->left);
+      AVL_PREFETCH(step->right);
+      lanes[i].node = step;
+      i++;
+    }
+  }
+
+  tree_unlock(tree);
+
+  return found;
+}
+
+  /**
+   *  @fn void avl_walk_parallel(avl *tree,
+   *                             avl_order order,
+   *                             avl_action action,
+   *                             int nthreads)
+   *
+   *  @brief walk @p tree with up to @p nthreads threads
+   *
+   *  Balanced AVL structure splits naturally: the top levels form a
+   *  small skeleton whose sub-trees are similar in size, and those
+   *  sub-trees are traversed concurrently by worker threads.  Only the
+   *  order-independent traversals run parallel - @a avl_pre_order and
+   *  @a avl_post_order, with no visit-order guarantee between threads
+   *  (parents still precede/follow their own sub-tree within a thread).
+   *  The ordered traversals fall back to the sequential avl_walk().
+   *
+   *  @p action must be thread-safe; a non-zero return stops only the
+   *  traversal of the sub-tree it occurred in.
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param order - traversal order
+   *  @param action - function that gets called for each node
+   *  @param nthreads - number of worker threads to use
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+void avl_walk_parallel(avl *tree,
+                       avl_order order,
+                       avl_action action,
+                       int nthreads)
+{
+  avl_node *skeleton[AVL_DUP_MAX_TASKS];
+  avl_node *tasks[AVL_DUP_MAX_TASKS];
+  pthread_t threads[AVL_DUP_MAX_TASKS];
+  walk_worker_args args[AVL_DUP_MAX_TASKS];
+  size_t nskel = 0, ntasks = 0, nworkers, started, i;
+  int level;
+
+  if (!tree || !action) return;
+
+  if (((order != avl_pre_order) && (order != avl_post_order))
+      || (nthreads <= 1) || !tree->root)
+  {
+    avl_walk(tree, order, action);
+    return;
+  }
+
+  if (nthreads > AVL_DUP_MAX_TASKS) nthreads = AVL_DUP_MAX_TASKS;
+
+  tree_rdlock(tree);
+
+  level = 1;
+  while (((1 << level) < (nthreads * 4))
+         && ((1 << (level + 1)) <= AVL_DUP_MAX_TASKS))
+    level++;
+
+  walk_collect(tree->root, level, skeleton, &nskel, tasks, &ntasks);
+
+    /*
+     * skeleton nodes are collected parent-first, so visiting them in
+     * collection order serves pre-order and reverse collection order
+     * serves post-order
+     */
+
+  if (order == avl_pre_order)
+    for (i = 0; i < nskel; i++) action(skeleton[i]);
+
+  nworkers = ((size_t)nthreads < ntasks) ? (size_t)nthreads : ntasks;
+
+  for (i = 0; i < nworkers; i++)
+  {
+    args[i].tasks = tasks;
+    args[i].ntasks = ntasks;
+    args[i].start = i;
+    args[i].stride = nworkers;
+    args[i].order = order;
+    args[i].action = action;
+  }
+
+  started = 0;
+  for (i = 0; i < nworkers; i++)
+  {
+    if (pthread_create(&threads[i], NULL, walk_worker, &args[i])) break;
+    started++;
+  }
+
+  for (i = started; i < nworkers; i++) walk_worker(&args[i]);
+  for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+  if (order == avl_post_order)
+    for (i = nskel; i > 0; i--) action(skeleton[i - 1]);
+
+  tree_unlock(tree);
+}
+
+  /**
+   *  @fn size_t avl_to_array(avl *tree, void **values, size_t cap)
+   *
+   *  @brief fill a caller buffer with the tree's values in key order
+   *
+   *  One iterative in-order pass with an explicit stack: no callback
+   *  invocation per node and no internal allocation, so the output
+   *  feeds straight into vectorized consumers.  Fills at most @p cap
+   *  entries; pair with avl_count() to size the buffer.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param values - caller buffer for the values
+   *  @param cap - capacity of @p values in entries
+   *
+   *  @return number of entries written
+   */
+
+size_t avl_to_array(avl *tree, void **values, size_t cap)
+{
+  size_t written;
+
+  if (!tree || !values) return 0;
+
+  tree_rdlock(tree);
+  written = export_in_order(tree, NULL, values, cap);
+  tree_unlock(tree);
+
+  return written;
+}
+
+  /**
+   *  @fn size_t avl_to_node_array(avl *tree, avl_node **nodes, size_t cap)
+   *
+   *  @brief fill a caller buffer with the tree's nodes in key order
+   *
+   *  Node-pointer variant of avl_to_array(); the natural feed for
+   *  avl_build_sorted() in a flatten-transform-rebuild pipeline.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param nodes - caller buffer for the node pointers
+   *  @param cap - capacity of @p nodes in entries
+   *
+   *  @return number of entries written
+   */
+
+size_t avl_to_node_array(avl *tree, avl_node **nodes, size_t cap)
+{
+  size_t written;
+
+  if (!tree || !nodes) return 0;
+
+  tree_rdlock(tree);
+  written = export_in_order(tree, nodes, NULL, cap);
+  tree_unlock(tree);
+
+  return written;
+}
+
+  /**
+   *  @fn avl_node *avl_select(avl *tree, size_t k)
+   *
+   *  @brief returns the node holding the k-th smallest key in @p tree
+   *
+   *  Order-statistics query over the sub-tree size counters: O(log n),
+   *  no walking.  Ranks are zero-based, so avl_select(tree, 0) is the
+   *  smallest key.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param k - zero-based rank of the wanted node
+   *
+   *  @return pointer to @a avl_node on success, NULL when k is out of range
+   */
+
+avl_node *avl_select(avl *tree, size_t k)
+{
+  avl_node *node = NULL;
+  size_t left_size;
+
+  if (!tree) goto exit;
+
+  tree_rdlock(tree);
+  node = tree->root;
+  while (node)
+  {
+    left_size = node_size(node->left);
+
+    if (k < left_size) node = node->left;
+    else if (k < left_size + node_mult(node)) break;
+    else
+    {
+      k -= left_size + node_mult(node);
+      node = node->right;
+    }
+  }
+  tree_unlock(tree);
+
+exit:
+  return node;
+}
+
+  /**
+   *  @fn avl_node *avl_first(avl *tree)
+   *
+   *  @brief returns the node holding the smallest key in @p tree
+   *
+   *  @param tree - pointer to existing AVL tree
+   *
+   *  @return pointer to @a avl_node, or NULL for an empty tree
+   */
+
+avl_node *avl_first(avl *tree)
+{
+  avl_node *node = NULL;
+
+  if (!tree) return NULL;
+
+  tree_rdlock(tree);
+  node = tree->root;
+  while (node && node->left) node = node->left;
+  tree_unlock(tree);
+
+  return node;
+}
+
+  /**
+   *  @fn avl_node *avl_last(avl *tree)
+   *
+   *  @brief returns the node holding the largest key in @p tree
+   *
+   *  @param tree - pointer to existing AVL tree
+   *
+   *  @return pointer to @a avl_node, or NULL for an empty tree
+   */
+
+avl_node *avl_last(avl *tree)
+{
+  avl_node *node = NULL;
+
+  if (!tree) return NULL;
+
+  tree_rdlock(tree);
+  node = tree->root;
+  while (node && node->right) node = node->right;
+  tree_unlock(tree);
+
+  return node;
+}
+
+  /**
+   *  @fn avl_node *avl_next(avl_node *node)
+   *
+   *  @brief returns the in-order successor of @p node
+   *
+   *  Amortized O(1) over a forward scan: each tree edge is crossed at
+   *  most twice, with no stack and no comparator calls.  Relies on the
+   *  parent links, which snapshot sharing does not maintain - do not
+   *  mix with trees that have live avl_snapshot() handles.
+   *
+   *  @param node - pointer to @a avl_node inside a tree
+   *
+   *  @return pointer to successor @a avl_node, or NULL at the end
+   */
+
+avl_node *avl_next(avl_node *node)
+{
+  if (!node) return NULL;
+
+  if (node->right)
+  {
+    node = node->right;
+    while (node->left) node = node->left;
+    return node;
+  }
+
+  while (node->parent && (node == node->parent->right)) node = node->parent;
+
+  return node->parent;
+}
+
+  /**
+   *  @fn avl_node *avl_prev(avl_node *node)
+   *
+   *  @brief returns the in-order predecessor of @p node
+   *
+   *  Mirror of avl_next(); the same parent-link caveats apply.
+   *
+   *  @param node - pointer to @a avl_node inside a tree
+   *
+   *  @return pointer to predecessor @a avl_node, or NULL at the start
+   */
+
+avl_node *avl_prev(avl_node *node)
+{
+  if (!node) return NULL;
+
+  if (node->left)
+  {
+    node = node->left;
+    while (node->right) node = node->right;
+    return node;
+  }
+
+  while (node->parent && (node == node->parent->left)) node = node->parent;
+
+  return node->parent;
+}
+
+  /**
+   *  @fn size_t avl_rank(avl *tree, avl_node *target)
+   *
+   *  @brief returns the zero-based rank of @p target in @p tree
+   *
+   *  The rank is the number of keys smaller than the match, so
+   *  avl_select(tree, avl_rank(tree, target)) returns the matching
+   *  node.  O(log n) through the sub-tree size counters.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param target - pointer to AVL NODE carrying the key to rank
+   *
+   *  @return zero-based rank, or (size_t)-1 when no match is found
+   */
+
+size_t avl_rank(avl *tree, avl_node *target)
+{
+  size_t rank = 0;
+  size_t below = 0;
+  avl_node *node;
+  int pos;
+
+  if (!tree || !target || !tree_has_cmp(tree)) return (size_t)-1;
+
+  rank = (size_t)-1;
+  tree_rdlock(tree);
+  node = tree->root;
+  while (node)
+  {
+    pos = node_cmp(tree, target, node);
+
+    if (pos < 0) node = node->left;
+    else if (pos > 0)
+    {
+      below += node_size(node->left) + node_mult(node);
+      node = node->right;
+    }
+    else
+    {
+      rank = below + node_size(node->left);
+      break;
+    }
+  }
+  tree_unlock(tree);
+
+  return rank;
+}
+
+  /**
+   *  @fn size_t avl_count(avl *tree)
+   *
+   *  @brief returns the number of nodes in @p tree
+   *
+   *  An O(1) read of the root's sub-tree size counter; no walk.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *
+   *  @return node count, 0 for an empty or NULL tree
+   */
+
+size_t avl_count(avl *tree)
+{
+  size_t count;
+
+  if (!tree) return 0;
+
+  tree_rdlock(tree);
+  count = node_size(tree->root);
+  tree_unlock(tree);
+
+  return count;
+}
+
+  /**
+   *  @fn size_t avl_memsize(avl *tree)
+   *
+   *  @brief bytes of memory held by @p tree and its nodes
+   *
+   *  Integrates with the active allocator backend: an arena tree is
+   *  charged for its whole slabs (including carved-but-unused
+   *  capacity), a plain tree for its live nodes plus whatever is parked
+   *  on the recycling freelist.  Node payloads belong to the caller and
+   *  are not counted, nor is per-allocation malloc bookkeeping.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *
+   *  @return total bytes, 0 for a NULL tree
+   */
+
+size_t avl_memsize(avl *tree)
+{
+  size_t bytes;
+  avl_slab *slab;
+
+  if (!tree) return 0;
+
+  bytes = sizeof(avl);
+  if (tree->lock) bytes += sizeof(avl_lock);
+
+  tree_rdlock(tree);
+
+  if (tree->arena)
+  {
+    bytes += sizeof(avl_arena);
+    for (slab = tree->arena->slabs; slab; slab = slab->next)
+      bytes += sizeof(avl_slab)
+               + (tree->arena->nodes_per_slab * sizeof(avl_node));
+  }
+  else
+    bytes += (node_size(tree->root) + tree->recycle_count)
+             * sizeof(avl_node);
+
+  tree_unlock(tree);
+
+  return bytes;
+}
+
+  /**
+   *  @fn int avl_get_shape(avl *tree, avl_shape *out)
+   *
+   *  @brief measure the shape quality of @p tree in one O(n) pass
+   *
+   *  Fills node count, height against the optimal ceil(log2(n+1)),
+   *  average node depth, and the leaf count with its depth spread - the
+   *  inputs for deciding when a rebuild/compaction cycle (avl_to_array()
+   *  plus avl_build_sorted()) is worth scheduling.  One iterative
+   *  traversal with an explicit stack; no callbacks.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param out - receives the report
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_get_shape(avl *tree, avl_shape *out)
+{
+  struct
+  {
+    avl_node *node;
+    size_t depth;
+  } stack[AVL_MAX_HEIGHT * 2];
+  size_t top = 0;
+  size_t depth_total = 0;
+  avl_node *node;
+  size_t depth, c;
+
+  if (!tree || !out) return -1;
+
+  memset(out, 0, sizeof(*out));
+  out->min_leaf_depth = (size_t)-1;
+
+  tree_rdlock(tree);
+
+  out->height = tree->height;
+
+  if (tree->root)
+  {
+    stack[top].node = tree->root;
+    stack[top].depth = 1;
+    top++;
+  }
+
+  while (top)
+  {
+    top--;
+    node = stack[top].node;
+    depth = stack[top].depth;
+
+    out->nodes++;
+    depth_total += depth;
+
+    if (!node->left && !node->right)
+    {
+      out->leaves++;
+      if (depth < out->min_leaf_depth) out->min_leaf_depth = depth;
+      if (depth > out->max_leaf_depth) out->max_leaf_depth = depth;
+    }
+
+    if (node->right)
+    {
+      stack[top].node = node->right;
+      stack[top].depth = depth + 1;
+      top++;
+    }
+    if (node->left)
+    {
+      stack[top].node = node->left;
+      stack[top].depth = depth + 1;
+      top++;
+    }
+  }
+
+  tree_unlock(tree);
+
+  if (!out->nodes) out->min_leaf_depth = 0;
+  else out->avg_depth = (double)depth_total / (double)out->nodes;
+
+  for (c = out->nodes; c; c >>= 1) out->optimal_height++;
+
+  return 0;
+}
+
+  /**
+   *  @fn void avl_walk(avl *tree, avl_order order, avl_action action)
+   *
+   *  @brief walk an AVL tree in requested order calling @p action on each node
+   *
+   *  The walk stops early as soon as @p action returns non-zero, so
+   *  partial scans do not keep visiting nodes they no longer care about.
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param order - @a avl_order; traversal order of nodes in tree
+   *  @param action - function that gets called for each encountered node
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+void avl_walk(avl *tree, avl_order order, avl_action action)
+{
+  if (!tree || !action) goto exit;
+
+  tree_rdlock(tree);
+  _avl_walk(tree->root, order, action);
+  tree_unlock(tree);
+
+exit:
+  return;
+}
+
+  /**
+   *  @fn void avl_walk_range(avl *tree,
+   *                          avl_node *lo,
+   *                          avl_node *hi,
+   *                          avl_action action)
+   *
+   *  @brief walk the nodes of @p tree with keys in [@p lo, @p hi] in
+   *         forward order, calling @p action on each
+   *
+   *  The descent prunes every sub-tree that lies entirely outside the
+   *  range, so a walk that matches k of n nodes costs O(log n + k)
+   *  rather than O(n).  Bounds are inclusive; a NULL @p lo or @p hi
+   *  leaves that end unbounded.  As with avl_walk(), a non-zero return
+   *  from @p action stops the walk early.
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param lo - pointer to AVL NODE carrying the lower bound key, or NULL
+   *  @param hi - pointer to AVL NODE carrying the upper bound key, or NULL
+   *  @param action - function that gets called for each node in range
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+void avl_walk_range(avl *tree, avl_node *lo, avl_node *hi, avl_action action)
+{
+  if (!tree || !action || !tree_has_cmp(tree)) goto exit;
+
+  tree_rdlock(tree);
+  range_walk(tree, tree->root, lo, hi, action);
+  tree_unlock(tree);
+
+exit:
+  return;
+}
+
+  /**
+   *  @fn void avl_set_new(avl *tree, avl_new_node new_node)
+   *
+   *  @brief sets function used by @p tree for created a new @a avl_node
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param new_node - function that creates a new @a avl_node for this tree
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+void avl_set_new(avl *tree, avl_new_node new_node)
+{
+  if (tree) tree->new_node = new_node;
+}
+
+  /**
+   *  @fn void avl_set_dup(avl *tree, avl_dup_node dup_node)
+   *
+   *  @brief sets function used by @p tree for duplicating an @a avl_node
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param dup_node - function that duplicates an @a avl_node for this tree
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+void avl_set_dup(avl *tree, avl_dup_node dup_node)
+{
+  if (tree) tree->dup_node = dup_node;
+}
+
+  /**
+   *  @fn void avl_set_free(avl *tree, avl_free_node free_node)
+   *
+   *  @brief sets function used by @p tree for freeing an @a avl_node
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param free_node - function that frees an @a avl_node for this tree
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+void avl_set_free(avl *tree, avl_free_node free_node)
+{
+  if (tree) tree->free_node = free_node;
+}
+
+  /**
+   *  @fn void avl_set_cmp(avl *tree, avl_cmp_node cmp_node)
+   *
+   *  @brief sets function used by @p tree for comparing two @a avl_node
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param cmp_node - function that compares two @a avl_node for this tree
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+void avl_set_cmp(avl *tree, avl_cmp_node cmp_node)
+{
+  if (!tree) return;
+
+  tree->cmp_node = cmp_node;
+  tree->key_kind = avl_key_custom;
+}
+
+  /**
+   *  @fn void avl_set_cmp_key(avl *tree, avl_cmp_key cmp_key)
+   *
+   *  @brief sets function used by @p tree for comparing a bare key to an
+   *         @a avl_node
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param cmp_key - function that compares a key to an @a avl_node for
+   *                   this tree
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+void avl_set_cmp_key(avl *tree, avl_cmp_key cmp_key)
+{
+  if (tree) tree->cmp_key = cmp_key;
+}
+
+  /**
+   *  @fn int avl_set_multi(avl *tree, int multi)
+   *
+   *  @brief switch @p tree between set and multiset semantics
+   *
+   *  On a multiset tree an equal-key insert bumps an in-node occurrence
+   *  count in the same single descent (avl_insert_value() still reports
+   *  1 for merged), and a delete decrements it, only removing the node
+   *  when the last occurrence goes.  avl_count()/avl_select()/
+   *  avl_rank() weight keys by occurrence, which is what a histogram
+   *  wants.  The occurrence count lives in the sub-tree size counters,
+   *  so the node does not grow.  Only an empty tree can switch modes.
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param multi - non-zero for multiset semantics
+   *
+   *  @return 0 on success, -1 when the tree is non-empty or frozen
+   */
+
+int avl_set_multi(avl *tree, int multi)
+{
+  if (!tree || tree->root || tree->frozen) return -1;
+
+  tree->multi = (multi != 0);
+
+  return 0;
+}
+
+  /**
+   *  @fn int avl_set_recycle(avl *tree, size_t limit)
+   *
+   *  @brief bound and enable the tree's deleted-node freelist
+   *
+   *  With recycling on, avl_delete() parks nodes on a per-tree freelist
+   *  instead of calling free(), and node creation pops from it before
+   *  touching malloc - steady-state delete+insert churn becomes
+   *  allocator-free.  Distinct from the arena: this serves long-lived
+   *  trees at stable size rather than bulk build/teardown.  As in arena
+   *  mode, a user supplied free_node function is treated as a payload
+   *  release hook while recycling is on and must not free the node
+   *  itself.  A limit of 0 turns recycling off and frees the parked
+   *  nodes.  Refused on concurrent trees, whose unsynchronized
+   *  avl_node_new() calls could race the freelist.
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param limit - most nodes the freelist may hold, 0 to disable
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_set_recycle(avl *tree, size_t limit)
+{
+  if (!tree || tree->arena || tree->lock || tree->frozen) return -1;
+
+  tree->recycle_limit = limit;
+  if (!limit) avl_recycle_trim(tree, 0);
+
+  return 0;
+}
+
+  /**
+   *  @fn void avl_recycle_trim(avl *tree, size_t keep)
+   *
+   *  @brief free parked nodes until at most @p keep remain
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param keep - number of freelist nodes to keep
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+void avl_recycle_trim(avl *tree, size_t keep)
+{
+  avl_node *node;
+
+  if (!tree) return;
+
+  while (tree->recycle_list && (tree->recycle_count > keep))
+  {
+    node = tree->recycle_list;
+    tree->recycle_list = node->right;
+    tree->recycle_count--;
+    free(node);
+  }
+}
+
+  /**
+   *  @fn int avl_set_engine(avl *tree, avl_engine engine)
+   *
+   *  @brief choose the rebalancing engine used by @p tree's insert path
+   *
+   *  Both engines produce identical trees; avl_engine_top_down fixes
+   *  balance in the downward pass (the lowest height-unequal ancestor
+   *  is remembered during the descent and receives the at-most-one
+   *  rotation an insertion needs) instead of retracing afterwards,
+   *  halving the stores on the path for write-heavy loads.  Deletion
+   *  always retraces bottom-up: a deletion can require a rotation at
+   *  every ancestor, which no single downward pass can anticipate.
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param engine - @a avl_engine_bottom_up or @a avl_engine_top_down
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_set_engine(avl *tree, avl_engine engine)
+{
+  if (!tree || tree->frozen) return -1;
+  if ((engine != avl_engine_bottom_up) && (engine != avl_engine_top_down))
+    return -1;
+
+  tree->engine = engine;
+
+  return 0;
+}
+
+  /**
+   *  @fn void avl_set_stats(avl *tree, int enable)
+   *
+   *  @brief turn hot-path counter collection on or off for @p tree
+   *
+   *  Enabling resets the counters.  When off - the default - the hot
+   *  paths pay one untaken branch per counter site.
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param enable - non-zero to collect counters
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+void avl_set_stats(avl *tree, int enable)
+{
+  if (!tree) return;
+
+  tree_wrlock(tree);
+  memset(&tree->stats, 0, sizeof(tree->stats));
+  tree->stats_on = (enable != 0);
+  tree_unlock(tree);
+}
+
+  /**
+   *  @fn int avl_get_stats(avl *tree, avl_stats *out)
+   *
+   *  @brief snapshot the hot-path counters of @p tree
+   *
+   *  @param tree - pointer to @a avl struct
+   *  @param out - receives a copy of the counters
+   *
+   *  @return 0 on success, -1 when stats are off or arguments are bad
+   */
+
+int avl_get_stats(avl *tree, avl_stats *out)
+{
+  if (!tree || !out) return -1;
+  if (!tree->stats_on) return -1;
+
+  tree_rdlock(tree);
+  *out = tree->stats;
+  tree_unlock(tree);
+
+  return 0;
+}
+
+      /*
+       *  AVL LOADER functions
+       */
+
+  /**
+   *  @fn avl_loader *avl_loader_begin(avl *tree)
+   *
+   *  @brief open a streaming loader on @p tree
+   *
+   *  Made for replication-style feeds that are mostly sorted: keys
+   *  above the current maximum append at the hot rightmost node with a
+   *  single comparison (no root descent, no comparator cascade), and
+   *  anything else falls back to the normal insert engine.  Duplicate
+   *  keys are released like avl_insert_batch() duplicates.  The tree
+   *  must not be queried or mutated through other entry points while
+   *  the loader is open.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *
+   *  @return pointer to new @a avl_loader, or NULL on failure
+   */
+
+avl_loader *avl_loader_begin(avl *tree)
+{
+  avl_loader *loader = NULL;
+  avl_node *node;
+
+  if (!tree || tree->frozen) goto exit;
+
+  loader = malloc(sizeof(avl_loader));
+  if (!loader) goto exit;
+
+  loader->tree = tree;
+  loader->hot = NULL;
+
+  tree_rdlock(tree);
+  node = tree->root;
+  while (node && node->right) node = node->right;
+  loader->hot = node;
+  tree_unlock(tree);
+
+exit:
+  return loader;
+}
+
+  /**
+   *  @fn int avl_loader_add(avl_loader *loader, avl_node *node)
+   *
+   *  @brief feed one node to a streaming loader
+   *
+   *  @param loader - pointer to open @a avl_loader
+   *  @param node - pointer to AVL NODE to insert
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_loader_add(avl_loader *loader, avl_node *node)
+{
+  avl *tree;
+  avl_node *p, *gp, *sub;
+  int new_height, balance, was_left, res;
+  int rv = -1;
+
+  if (!loader || !node) return -1;
+
+  tree = loader->tree;
+
+  tree_wrlock(tree);
+
+  if (!tree->persistent && loader->hot
+      && (node_cmp(tree, node, loader->hot) > 0))
+  {
+      /*
+       * in-order fast path: the hot node is the maximum, so its right
+       * slot is free; one comparison, then counters and a retrace that
+       * almost always stops immediately
+       */
+
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = loader->hot;
+    node->height = 1;
+    node->size = 1;
+    node->refs = 1;
+
+    loader->hot->right = node;
+    loader->hot = node;
+
+    if (tree->stats_on) tree->stats.inserts++;
+
+    for (p = node->parent; p; p = p->parent) p->size++;
+
+    p = node->parent;
+    while (p)
+    {
+      new_height = 1 + max(height(p->left), height(p->right));
+      if (new_height == p->height) break;
+      p->height = new_height;
+
+      balance = avl_get_balance(p);
+      if ((balance <= 1) && (balance >= -1))
+      {
+        p = p->parent;
+        continue;
+      }
+
+      gp = p->parent;
+      was_left = gp && (gp->left == p);
+
+      if (balance > 1)
+      {
+        if (avl_get_balance(p->left) < 0)
+          p->left = avl_rotate_left(p->left);
+        sub = avl_rotate_right(p);
+      }
+      else
+      {
+        if (avl_get_balance(p->right) > 0)
+          p->right = avl_rotate_right(p->right);
+        sub = avl_rotate_left(p);
+      }
+
+      if (tree->stats_on) tree->stats.rotations++;
+
+      if (!gp) tree->root = sub;
+      else if (was_left) gp->left = sub;
+      else gp->right = sub;
+
+      break;
+    }
+
+    tree->height = height(tree->root);
+    tree_unlock(tree);
+
+    return 0;
+  }
+
+    /*
+     * out-of-order (or persistent, or first-ever) record: the normal
+     * engine handles it, then the hot hint is refreshed
+     */
+
+  res = tree_insert(tree, &tree->root, node, NULL);
+  if (res >= 0)
+  {
+    if (res == 1) _avl_node_release(tree, node);
+    tree->height = height(tree->root);
+
+    if (!loader->hot)
+    {
+      p = tree->root;
+      while (p && p->right) p = p->right;
+      loader->hot = p;
+    }
+
+    rv = 0;
+  }
+
+  tree_unlock(tree);
+
+  return rv;
+}
+
+  /**
+   *  @fn int avl_loader_end(avl_loader *loader)
+   *
+   *  @brief close a streaming loader
+   *
+   *  @param loader - pointer to open @a avl_loader
+   *
+   *  @return 0 on success, -1 on failure
+   */
+
+int avl_loader_end(avl_loader *loader)
+{
+  if (!loader) return -1;
+
+  free(loader);
+
+  return 0;
+}
+
+      /*
+       *  AVL NODE functions
+       */
+
+  /**
+   *  @fn avl_node *avl_node_new(avl *tree, void *value)
+   *
+   *  @brief creates a new @a avl_node
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param value - pointer to payload that is attached to the node
+   *
+   *  @return pointer to @a avl_node on success, NULL on failure
+   */
+
+avl_node *avl_node_new(avl *tree, void *value)
+{
+  avl_node *node = NULL;
+
+  if (!tree) goto exit;
+
+  if (tree->new_node) node = tree->new_node();
+  else node = _avl_node_new(tree, value);
+
+exit:
+  return node;
+}
+
+  /**
+   *  @fn void avl_node_init(avl_node *node, void *value)
+   *
+   *  @brief prepares a caller-owned @a avl_node for insertion
+   *
+   *  Companion to avl_node_new() for intrusive use: the node typically
+   *  lives embedded in the caller's record (see the container_of-style
+   *  contract in avl.h), so no allocation happens here.  Deletion hands
+   *  the node to the tree's free_node function, which intrusive callers
+   *  must set.
+   *
+   *  @param node - pointer to caller-owned AVL NODE storage
+   *  @param value - pointer to payload that is attached to the node
+   *
+   *  @par Returns
+   *       Nothing.
+   */
+
+void avl_node_init(avl_node *node, void *value)
+{
+  if (!node) return;
+
+  memset(node, 0, sizeof(avl_node));
+  node->value = value;
+  node->height = 1;
+  node->size = 1;
+  node->refs = 1;
+}
+
+  /**
+   *  @fn avl_node *avl_node_dup(avl *tree, avl_node *node)
+   *
+   *  @brief duplicates an @a avl_node
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param node - pointer to existing AVL NODE struct
+   *
+   *  @return pointer to @a avl_node on success, NULL on failure
+   */
+
+avl_node *avl_node_dup(avl *tree, avl_node *node)
+{
+  avl_node *new_node = NULL;
+
+  if (!tree || !node) goto exit;
+
+  if (tree->dup_node) new_node = tree->dup_node(node);
+  else
+  {
+    new_node = _avl_node_new(tree, NULL);
+    if (!new_node) goto exit;
+    new_node->value = node->value;
+  }
+
+exit:
+  return new_node;
+}
+
+  /**
+   *  @fn void avl_node_free(avl *tree, avl_node *node)
+   *
+   *  @brief frees memory allocated to @p node
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param node - pointer to existing AVL NODE struct
+   *
+   *  @par Returns
+   *       Nothing.
+   */
+
+void avl_node_free(avl *tree, avl_node *node)
+{
+  if (!tree || !node) return;
+
+  _avl_node_release(tree, node);
+}
+
+  /**
+   *  @fn int avl_node_cmp(avl *tree, avl_node *a, avl_node *b)
+   *
+   *  @brief compares @p a and @p b
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param a - pointer to existing AVL NODE struct
+   *  @param b - pointer to existing AVL NODE struct
+   *
+   *  @return -1 if a<b, 0 if a==b, 1 if a>b
+   */
+
+int avl_node_cmp(avl *tree, avl_node *a, avl_node *b)
+{
+  if (!tree || !a || !b) return 0;
+  if (!tree_has_cmp(tree)) return 0;
+
+  return node_cmp(tree, a, b);
+}
+
+      /*
+       *  AVL ITER functions
+       */
+
+  /**
+   *  @fn avl_iter *avl_iter_begin(avl *tree, avl_order order)
+   *
+   *  @brief open a cursor over @p tree positioned before the first node
+   *
+   *  Only @a avl_forward_order and @a avl_reverse_order are supported;
+   *  the cursor traverses with an explicit stack, so it can be paused,
+   *  resumed and consumed in batches with no callback per node.  The
+   *  tree must not be modified while the cursor is open.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param order - @a avl_forward_order or @a avl_reverse_order
+   *
+   *  @return pointer to new @a avl_iter, or NULL on failure
+   */
+
+avl_iter *avl_iter_begin(avl *tree, avl_order order)
+{
+  avl_iter *iter = NULL;
+
+  if (!tree) goto exit;
+  if ((order != avl_forward_order) && (order != avl_reverse_order))
+    goto exit;
+
+  iter = malloc(sizeof(avl_iter));
+  if (!iter) goto exit;
+
+  memset(iter, 0, sizeof(avl_iter));
+  iter->tree = tree;
+  iter->order = order;
+
+    /*
+     * a cursor over a concurrent tree holds the read lock until it is
+     * closed with avl_iter_end()
+     */
+
+  tree_rdlock(tree);
+  iter_push_spine(iter, tree->root);
+
+exit:
+  return iter;
+}
+
+  /**
+   *  @fn avl_iter *avl_iter_begin_range(avl *tree, avl_node *lo, avl_node *hi)
+   *
+   *  @brief open a forward cursor over the keys of @p tree in [@p lo, @p hi]
+   *
+   *  Cursor companion to avl_walk_range(): the cursor starts at the
+   *  first key at-or-above @p lo and reports exhaustion once the next
+   *  key would exceed @p hi.  Bounds are inclusive; a NULL @p lo or
+   *  @p hi leaves that end unbounded.
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param lo - pointer to AVL NODE carrying the lower bound key, or NULL
+   *  @param hi - pointer to AVL NODE carrying the upper bound key, or NULL
+   *
+   *  @return pointer to new @a avl_iter, or NULL on failure
+   */
+
+avl_iter *avl_iter_begin_range(avl *tree, avl_node *lo, avl_node *hi)
+{
+  avl_iter *iter = NULL;
+
+  if (!tree || !tree_has_cmp(tree)) goto exit;
+
+  iter = avl_iter_begin(tree, avl_forward_order);
+  if (!iter) goto exit;
+
+  if (lo) avl_iter_seek(iter, lo);
+  iter->hi = hi;
+
+exit:
+  return iter;
+}
+
+  /**
+   *  @fn avl_node *avl_iter_next(avl_iter *iter)
+   *
+   *  @brief return the next node under the cursor and advance it
+   *
+   *  @param iter - pointer to open @a avl_iter
+   *
+   *  @return pointer to next @a avl_node, or NULL when exhausted
+   */
+
+avl_node *avl_iter_next(avl_iter *iter)
+{
+  avl_node *node = NULL;
+
+  if (!iter || !iter->depth) goto exit;
+
+  node = iter->path[--iter->depth];
+
+  if (iter->hi && (node_cmp(iter->tree, iter->hi, node) < 0))
+  {
+      /*
+       * range cursor ran past its upper bound
+       */
+
+    iter->depth = 0;
+    node = NULL;
+    goto exit;
+  }
+
+  if (iter->order == avl_forward_order) iter_push_spine(iter, node->right);
+  else iter_push_spine(iter, node->left);
+
+exit:
+  return node;
+}
+
+  /**
+   *  @fn int avl_iter_seek(avl_iter *iter, avl_node *target)
+   *
+   *  @brief position the cursor at @p target, or the nearest node after it
+   *
+   *  A forward cursor is left so that the next avl_iter_next() returns
+   *  the first node with key >= @p target; a reverse cursor, the last
+   *  node with key <= @p target.  Uses the tree's cmp_node function.
+   *
+   *  @param iter - pointer to open @a avl_iter
+   *  @param target - pointer to AVL NODE carrying the key to seek to
+   *
+   *  @return 0 when the cursor has nodes left to visit, -1 otherwise
+   */
+
+int avl_iter_seek(avl_iter *iter, avl_node *target)
+{
+  avl_node *node;
+  int pos;
+
+  if (!iter || !target || !iter->tree || !tree_has_cmp(iter->tree)) return -1;
+
+  iter->depth = 0;
+
+  node = iter->tree->root;
+  while (node)
+  {
+    pos = node_cmp(iter->tree, target, node);
+
+    if (pos == 0)
+    {
+      iter->path[iter->depth++] = node;
+      break;
+    }
+
+    if (iter->order == avl_forward_order)
+    {
+      if (pos < 0) iter->path[iter->depth++] = node;
+      node = (pos < 0) ? node->left : node->right;
+    }
+    else
+    {
+      if (pos > 0) iter->path[iter->depth++] = node;
+      node = (pos < 0) ? node->left : node->right;
+    }
+  }
+
+  return iter->depth ? 0 : -1;
+}
+
+  /**
+   *  @fn void avl_iter_end(avl_iter *iter)
+   *
+   *  @brief close a cursor and free its memory
+   *
+   *  @param iter - pointer to open @a avl_iter
+   *
+   *  @par Returns
+   *       Nothing.
+   */
+
+void avl_iter_end(avl_iter *iter)
+{
+  if (!iter) return;
+
+  tree_unlock(iter->tree);
+  free(iter);
+}
+
+    /*
+     * private functions
+     */
+
+  /**
+   *  @fn int _avl_insert(avl *tree,
+   *                      avl_node **rootp,
+   *                      avl_node *item,
+   *                      avl_node **existing)
+   *
+   *  @brief Insert a node into the tree at @p rootp
+   *
+   *  The descent path is recorded in an explicit stack together with the
+   *  direction taken at each level, so the comparator is invoked exactly
+   *  once per level; the recorded directions drive the LL/RR/LR/RL
+   *  rebalance decision instead of re-invoking the comparator.  The
+   *  retrace stops as soon as a node's height is unchanged, or after the
+   *  single rotation an insertion can require.
+   *
+   *  On a persistent tree every node visited is made private to this
+   *  version first (see node_private()), so shared snapshot nodes are
+   *  never mutated.
+   *
+   *  @param tree - pointer to @a avl struct that owns the nodes
+   *  @param rootp - address of root pointer of tree to insert into
+   *  @param item - pointer to existing @a avl_node, new node to insert
+   *  @param existing - when non-NULL, receives the already-present node on a
+   *                    duplicate key, or NULL when @p item was inserted
+   *
+   *  @return 0 when inserted, 1 on a duplicate key, -1 on failure
+   */
+
+static int _avl_insert(avl *tree,
+                       avl_node **rootp,
+                       avl_node *item,
+                       avl_node **existing)
+{
+  avl_node *path[AVL_MAX_HEIGHT];
+  int dir[AVL_MAX_HEIGHT];
+  int depth = 0;
+  avl_node *node, *sub, **linkp;
+  int pos = 0;
+  int i;
+  int new_height;
+  int balance;
+
+  if (existing) *existing = NULL;
+
+  if (!tree || !rootp || !item) return -1;
+
+  if (!*rootp)
+  {
+    item->size = 1;
+    item->refs = 1;
+    item->parent = NULL;
+    *rootp = item;
+    if (tree->stats_on) tree->stats.inserts++;
+    return 0;
+  }
+
+    /*
+     * Perform the normal BST descent, remembering the path taken
+     */
+
+  linkp = rootp;
+  node = node_private(tree, linkp);
+  if (!node) return -1;
+
+  for (;;)
+  {
+    pos = node_cmp(tree, item, node);
+    if (pos == 0)
+    {
+      if (tree->multi)
+      {
+          /*
+           * multiset: the key gains an occurrence; every ancestor's
+           * count grows with it, no structural change
+           */
+
+        node->size++;
+        for (i = 0; i < depth; i++) path[i]->size++;
+      }
+      if (existing) *existing = node;
+      return 1;
+    }
+
+    if (depth >= AVL_MAX_HEIGHT) return -1;
+    path[depth] = node;
+    dir[depth] = (pos > 0);
+    depth++;
+
+    linkp = (pos < 0) ? &node->left : &node->right;
+    if (!*linkp) break;
+
+    node = node_private(tree, linkp);
+    if (!node) return -1;
+  }
+
+  *linkp = item;
+  item->parent = node;
+
+    /*
+     * Every ancestor gains one descendant, even the ones the height
+     * retrace below never reaches
+     */
+
+  item->size = 1;
+  item->refs = 1;
+  for (i = 0; i < depth; i++) path[i]->size++;
+
+    /*
+     * Retrace toward the root, updating heights until they stop
+     * changing; an insertion unbalances at most one ancestor and a
+     * single (possibly double) rotation there restores the sub-tree to
+     * its pre-insertion height
+     */
+
+  while (depth-- > 0)
+  {
+    node = path[depth];
+
+    if (tree->stats_on) tree->stats.insert_retrace_total++;
+
+    new_height = 1 + max(height(node->left), height(node->right));
+    if (new_height == node->height) break;
+    node->height = new_height;
+
+    balance = avl_get_balance(node);
+    if ((balance <= 1) && (balance >= -1)) continue;
+
+    if (balance > 1)
+    {
+        /*
+         * Left Left or Left Right Case, by remembered direction
+         */
+
+      if (dir[depth + 1])
+      {
+        node->left = avl_rotate_left(node->left);
+        if (tree->stats_on) tree->stats.rotations++;
+      }
+      sub = avl_rotate_right(node);
+    }
+    else
+    {
+        /*
+         * Right Right or Right Left Case, by remembered direction
+         */
+
+      if (!dir[depth + 1])
+      {
+        node->right = avl_rotate_right(node->right);
+        if (tree->stats_on) tree->stats.rotations++;
+      }
+      sub = avl_rotate_left(node);
+    }
+
+    if (tree->stats_on) tree->stats.rotations++;
+
+    if (depth == 0) *rootp = sub;
+    else if (dir[depth - 1]) path[depth - 1]->right = sub;
+    else path[depth - 1]->left = sub;
+
+    break;
+  }
+
+  if (tree->stats_on) tree->stats.inserts++;
+
+  return 0;
+}
+
+  /**
+   *  @fn int _avl_insert_topdown(avl *tree,
+   *                              avl_node **rootp,
+   *                              avl_node *item,
+   *                              avl_node **existing)
+   *
+   *  @brief single-pass insert: balance is fixed on the way down
+   *
+   *  During the descent the engine remembers S, the lowest node whose
+   *  sub-tree heights differ; every node below S is perfectly balanced,
+   *  so after the attach their heights simply grow by one, S either
+   *  absorbs the growth (it grew on its lighter side), needs the single
+   *  rotation (heavier side), and nothing above S changes at all.
+   *  Sub-tree sizes are bumped during the descent itself.  There is no
+   *  retrace loop.
+   *
+   *  @param tree - pointer to @a avl struct that owns the nodes
+   *  @param rootp - address of root pointer of tree to insert into
+   *  @param item - pointer to existing @a avl_node, new node to insert
+   *  @param existing - when non-NULL, receives the already-present node on a
+   *                    duplicate key, or NULL when @p item was inserted
+   *
+   *  @return 0 when inserted, 1 on a duplicate key, -1 on failure
+   */
+
+static int _avl_insert_topdown(avl *tree,
+                               avl_node **rootp,
+                               avl_node *item,
+                               avl_node **existing)
+{
+  avl_node *path[AVL_MAX_HEIGHT];
+  int dir[AVL_MAX_HEIGHT];
+  int depth = 0;
+  int sdepth = -1;
+  avl_node *node, *sub, **linkp;
+  int pos = 0;
+  int i;
+  int balance;
+
+  if (existing) *existing = NULL;
+
+  if (!tree || !rootp || !item) return -1;
+
+  if (!*rootp)
+  {
+    item->size = 1;
+    item->refs = 1;
+    item->parent = NULL;
+    *rootp = item;
+    if (tree->stats_on) tree->stats.inserts++;
+    return 0;
+  }
+
+    /*
+     * one descent: sizes are bumped speculatively, the lowest
+     * height-unequal node is remembered as S
+     */
+
+  linkp = rootp;
+  node = node_private(tree, linkp);
+  if (!node) return -1;
+
+  for (;;)
+  {
+    pos = node_cmp(tree, item, node);
+    if (pos == 0)
+    {
+        /*
+         * duplicate: a multiset keeps the speculative size bumps as
+         * the new occurrence; a set takes them back
+         */
+
+      if (tree->multi) node->size++;
+      else for (i = 0; i < depth; i++) path[i]->size--;
+
+      if (existing) *existing = node;
+      return 1;
+    }
+
+    if (depth >= AVL_MAX_HEIGHT)
+    {
+      for (i = 0; i < depth; i++) path[i]->size--;
+      return -1;
+    }
+
+    if (avl_get_balance(node)) sdepth = depth;
+
+    node->size++;
+    path[depth] = node;
+    dir[depth] = (pos > 0);
+    depth++;
+
+    linkp = (pos < 0) ? &node->left : &node->right;
+    if (!*linkp) break;
+
+    node = node_private(tree, linkp);
+    if (!node)
+    {
+      for (i = 0; i < depth; i++) path[i]->size--;
+      return -1;
+    }
+  }
+
+  *linkp = item;
+  item->parent = node;
+  item->size = 1;
+  item->refs = 1;
+
+  if (tree->stats_on) tree->stats.inserts++;
+
+  if (sdepth < 0)
+  {
+      /*
+       * the whole path was perfectly balanced: every node on it grows
+       */
+
+    for (i = 0; i < depth; i++) path[i]->height++;
+    return 0;
+  }
+
+    /*
+     * below S every node was balanced and now grows by one; S itself
+     * either evens out or needs the rotation
+     */
+
+  for (i = sdepth + 1; i < depth; i++) path[i]->height++;
+
+  node = path[sdepth];
+  balance = avl_get_balance(node);
+
+  if ((balance <= 1) && (balance >= -1)) return 0;
+
+  if (balance > 1)
+  {
+    if (dir[sdepth + 1])
+    {
+      node->left = avl_rotate_left(node->left);
+      if (tree->stats_on) tree->stats.rotations++;
+    }
+    sub = avl_rotate_right(node);
+  }
+  else
+  {
+    if (!dir[sdepth + 1])
+    {
+      node->right = avl_rotate_right(node->right);
+      if (tree->stats_on) tree->stats.rotations++;
+    }
+    sub = avl_rotate_left(node);
+  }
+
+  if (tree->stats_on) tree->stats.rotations++;
+
+  if (sdepth == 0) *rootp = sub;
+  else if (dir[sdepth - 1]) path[sdepth - 1]->right = sub;
+  else path[sdepth - 1]->left = sub;
+
+  return 0;
+}
+
+  /**
+   *  @fn int tree_insert(avl *tree,
+   *                      avl_node **rootp,
+   *                      avl_node *item,
+   *                      avl_node **existing)
+   *
+   *  @brief dispatch an insert to the tree's selected engine
+   *
+   *  @param tree - pointer to @a avl struct that owns the nodes
+   *  @param rootp - address of root pointer of tree to insert into
+   *  @param item - pointer to existing @a avl_node, new node to insert
+   *  @param existing - see _avl_insert()
+   *
+   *  @return 0 when inserted, 1 on a duplicate key, -1 on failure
+   */
+
+static int tree_insert(avl *tree,
+                       avl_node **rootp,
+                       avl_node *item,
+                       avl_node **existing)
+{
+  if (tree && (tree->engine == avl_engine_top_down))
+    return _avl_insert_topdown(tree, rootp, item, existing);
+
+  return _avl_insert(tree, rootp, item, existing);
+}
+
+  /**
+   *  @fn avl_node *_avl_build_sorted(avl_node **items, size_t lo, size_t hi)
+   *
+   *  @brief link the nodes in items[lo..hi) into a height-balanced tree
+   *
+   *  The midpoint becomes the sub-tree root; halves of equal-or-one-off
+   *  size hang off either side, so sibling heights never differ by more
+   *  than one.
+   *
+   *  @param items - array of nodes, sorted ascending by key
+   *  @param lo - index of first node in the slice
+   *  @param hi - index one past the last node in the slice
+   *
+   *  @return pointer to root of the built sub-tree, NULL for an empty slice
+   */
+
+static avl_node *_avl_build_sorted(avl_node **items, size_t lo, size_t hi)
+{
+  size_t mid;
+  avl_node *node;
+
+  if (lo >= hi) return NULL;
+
+  mid = lo + ((hi - lo) / 2);
+  node = items[mid];
+
+  node->left = _avl_build_sorted(items, lo, mid);
+  node->right = _avl_build_sorted(items, mid + 1, hi);
+  node->height = 1 + max(height(node->left), height(node->right));
+  node->size = hi - lo;
+  node->refs = 1;
+  if (node->left) node->left->parent = node;
+  if (node->right) node->right->parent = node;
+
+  return node;
+}
+
+  /**
+   *  @fn void sort_nodes(avl *tree,
+   *                      avl_node **items,
+   *                      avl_node **tmp,
+   *                      size_t n)
+   *
+   *  @brief sort an array of nodes by the tree's key order
+   *
+   *  Top-down merge sort: stable, O(n log n) worst case, no comparator
+   *  context smuggling through globals the way qsort() would need.
+   *
+   *  @param tree - pointer to @a avl struct whose order is used
+   *  @param items - array of nodes to sort in place
+   *  @param tmp - scratch array of at least @p n entries
+   *  @param n - number of nodes in @p items
+   *
+   *  @par Returns
+   *       Nothing.
+   */
+
+static void sort_nodes(avl *tree,
+                       avl_node **items,
+                       avl_node **tmp,
+                       size_t n)
+{
+  size_t mid, i, j, o;
+
+  if (n < 2) return;
+
+  mid = n / 2;
+  sort_nodes(tree, items, tmp, mid);
+  sort_nodes(tree, items + mid, tmp, n - mid);
+
+  i = 0;
+  j = mid;
+  o = 0;
+  while ((i < mid) || (j < n))
+  {
+    if (j >= n) tmp[o++] = items[i++];
+    else if (i >= mid) tmp[o++] = items[j++];
+    else if (node_cmp(tree, items[j], items[i]) < 0) tmp[o++] = items[j++];
+    else tmp[o++] = items[i++];
+  }
+
+  memcpy(items, tmp, n * sizeof(avl_node *));
+}
+
+  /**
+   *  @fn size_t export_in_order(avl *tree,
+   *                             avl_node **nodes,
+   *                             void **values,
+   *                             size_t cap)
+   *
+   *  @brief write the tree's nodes or values in key order into a buffer
+   *
+   *  @param tree - pointer to existing AVL tree
+   *  @param nodes - destination for node pointers, or NULL
+   *  @param values - destination for values, or NULL
+   *  @param cap - buffer capacity in entries
+   *
+   *  @return number of entries written
+   */
+
+static size_t export_in_order(avl *tree,
+                              avl_node **nodes,
+                              void **values,
+                              size_t cap)
+{
+  avl_node *stack[AVL_MAX_HEIGHT];
+  int depth = 0;
+  avl_node *node;
+  size_t written = 0;
+
+  node = tree->root;
+  while ((node || depth) && (written < cap))
+  {
+    while (node)
+    {
+      stack[depth++] = node;
+      node = node->left;
+    }
+
+    node = stack[--depth];
+
+    if (nodes) nodes[written] = node;
+    else values[written] = node->value;
+    written++;
+
+    node = node->right;
+  }
+
+  return written;
+}
+
+  /**
+   *  @fn avl_node *rebalance_node(avl *tree, avl_node *node)
+   *
+   *  @brief refresh one node's height and size, rotating if unbalanced
+   *
+   *  Shared by the join/split machinery, which can leave a node up to
+   *  two levels out of balance on the way back up.
+   *
+   *  @param tree - pointer to @a avl struct that owns the node
+   *  @param node - pointer to @a avl_node to refresh
+   *
+   *  @return pointer to the (possibly rotated) sub-tree root
+   */
+
+static avl_node *rebalance_node(avl *tree, avl_node *node)
+{
+  int balance;
+
+  node->height = 1 + max(height(node->left), height(node->right));
+  node->size = 1 + node_size(node->left) + node_size(node->right);
+
+  balance = avl_get_balance(node);
+
+  if (balance > 1)
+  {
+    if (avl_get_balance(node->left) < 0)
+    {
+      node->left = avl_rotate_left(node->left);
+      if (tree->stats_on) tree->stats.rotations++;
+    }
+    if (tree->stats_on) tree->stats.rotations++;
+    return avl_rotate_right(node);
+  }
+
+  if (balance < -1)
+  {
+    if (avl_get_balance(node->right) > 0)
+    {
+      node->right = avl_rotate_right(node->right);
+      if (tree->stats_on) tree->stats.rotations++;
+    }
+    if (tree->stats_on) tree->stats.rotations++;
+    return avl_rotate_left(node);
+  }
+
+  return node;
+}
+
+  /**
+   *  @fn avl_node *join_nodes(avl *tree, avl_node *tl, avl_node *k, avl_node *tr)
+   *
+   *  @brief join two sub-trees around a middle node in O(height delta)
+   *
+   *  All keys in @p tl sort below @p k, all keys in @p tr above it.
+   *  The taller side is descended along its inner spine until the
+   *  heights meet, @p k is attached there, and the spine is rebalanced
+   *  on the way back out.
+   *
+   *  @param tree - pointer to @a avl struct that owns the nodes
+   *  @param tl - pointer to root of the lesser sub-tree, may be NULL
+   *  @param k - pointer to the middle @a avl_node
+   *  @param tr - pointer to root of the greater sub-tree, may be NULL
+   *
+   *  @return pointer to root of the joined sub-tree
+   */
+
+static avl_node *join_nodes(avl *tree, avl_node *tl, avl_node *k, avl_node *tr)
+{
+  int hl = height(tl);
+  int hr = height(tr);
+
+  if (hl > hr + 1)
+  {
+    tl->right = join_nodes(tree, tl->right, k, tr);
+    tl->right->parent = tl;
+    return rebalance_node(tree, tl);
+  }
+
+  if (hr > hl + 1)
+  {
+    tr->left = join_nodes(tree, tl, k, tr->left);
+    tr->left->parent = tr;
+    return rebalance_node(tree, tr);
+  }
+
+  k->left = tl;
+  k->right = tr;
+  if (tl) tl->parent = k;
+  if (tr) tr->parent = k;
+  k->parent = NULL;
+  k->height = 1 + max(hl, hr);
+  k->size = 1 + node_size(tl) + node_size(tr);
+  k->refs = 1;
+
+  return k;
+}
+
+  /**
+   *  @fn void split_nodes(avl *tree,
+   *                       avl_node *root,
+   *                       avl_node *pivot,
+   *                       avl_node **lo,
+   *                       avl_node **hi)
+   *
+   *  @brief split a sub-tree into the parts below and at-or-above a pivot
+   *
+   *  Classic join-based split: each level contributes its root node and
+   *  one untouched sub-tree to one side, O(log n) join work in total.
+   *
+   *  @param tree - pointer to @a avl struct whose order is used
+   *  @param root - pointer to root @a avl_node of sub-tree
+   *  @param pivot - pointer to AVL NODE carrying the split key
+   *  @param lo - receives the sub-tree of keys below the pivot
+   *  @param hi - receives the sub-tree of keys at-or-above the pivot
+   *
+   *  @par Returns
+   *       Nothing.
+   */
+
+static void split_nodes(avl *tree,
+                        avl_node *root,
+                        avl_node *pivot,
+                        avl_node **lo,
+                        avl_node **hi)
+{
+  avl_node *part;
+  int pos;
+
+  if (!root)
+  {
+    *lo = NULL;
+    *hi = NULL;
+    return;
+  }
+
+  pos = node_cmp(tree, pivot, root);
+
+  if (pos <= 0)
+  {
+      /*
+       * root sorts at-or-above the pivot: it joins the hi side with its
+       * right sub-tree
+       */
+
+    split_nodes(tree, root->left, pivot, lo, &part);
+    *hi = join_nodes(tree, part, root, root->right);
+  }
+  else
+  {
+    split_nodes(tree, root->right, pivot, &part, hi);
+    *lo = join_nodes(tree, root->left, root, part);
+  }
+}
+
+  /**
+   *  @fn avl_node *unlink_last(avl *tree)
+   *
+   *  @brief detach the largest node from @p tree without releasing it
+   *
+   *  The rightmost node has no right child, so its left sub-tree is
+   *  lifted into its place and the path back to the root refreshed
+   *  through rebalance_node().
+   *
+   *  @param tree - pointer to existing, non-empty AVL tree
+   *
+   *  @return pointer to the detached @a avl_node
+   */
+
+static avl_node *unlink_last(avl *tree)
+{
+  avl_node *k, *p, *gp, *sub;
+  int was_left;
+
+  k = tree->root;
+  while (k->right) k = k->right;
+
+  p = k->parent;
+  if (k->left) k->left->parent = p;
+  if (p) p->right = k->left;
+  else tree->root = k->left;
+
+  while (p)
+  {
+    gp = p->parent;
+    was_left = gp && (gp->left == p);
+
+    sub = rebalance_node(tree, p);
+
+    if (!gp) tree->root = sub;
+    else if (was_left) gp->left = sub;
+    else gp->right = sub;
+
+    p = gp;
+  }
+
+  if (tree->root) tree->root->parent = NULL;
+  tree->height = height(tree->root);
+
+  k->left = NULL;
+  k->right = NULL;
+  k->parent = NULL;
+  k->height = 1;
+  k->size = 1;
+
+  return k;
+}
+
+  /**
+   *  @fn int _avl_delete(avl *tree,
+   *                      avl_node **rootp,
+   *                      avl_node *target,
+   *                      const void *key)
+   *
+   *  @brief deletes the node matching @p target or @p key from the tree
+   *         at @p rootp
+   *
+   *  The descent path is recorded in an explicit stack; when the victim
+   *  has two children its in-order successor is spliced into its place
+   *  by pointer surgery (no payload copying).  The retrace recomputes
+   *  heights and rebalances bottom-up, and stops as soon as a sub-tree
+   *  comes out of a step at its pre-deletion height, since nothing above
+   *  it can have changed.
+   *
+   *  The victim is located through cmp_node when @p target is given, or
+   *  through cmp_key and @p key when it is NULL.
+   *
+   *  @param tree - pointer to @a avl struct that owns the nodes
+   *  @param rootp - address of root pointer of tree to delete from
+   *  @param target - pointer to @a avl_node containing target key to delete
+   *  @param key - bare key to delete, used when @p target is NULL
+   *
+   *  @return 0 when a node was deleted, -1 when no match was found
+   */
+
+static int _avl_delete(avl *tree,
+                       avl_node **rootp,
+                       avl_node *target,
+                       const void *key)
+{
+  avl_node *path[AVL_MAX_HEIGHT];
+  int dir[AVL_MAX_HEIGHT];
+  int depth = 0;
+  int vdepth = 0;
+  avl_node *node, *child, *succ, *sub, **linkp;
+  size_t spine_dec = 1;
+  int pos = 0;
+  int i;
+  int old_height, new_height;
+  int balance;
+
+  if (!tree || !rootp || !*rootp) return -1;
+  if (target ? !tree_has_cmp(tree) : !tree_has_key_cmp(tree)) return -1;
+
+    /*
+     * Standard BST descent, remembering the path taken
+     */
+
+  linkp = rootp;
+  node = node_private(tree, linkp);
+  if (!node) return -1;
+
+  for (;;)
+  {
+    pos = target ? node_cmp(tree, target, node) : key_cmp(tree, key, node);
+    if (pos == 0) break;
+
+    if (depth >= AVL_MAX_HEIGHT) return -1;
+    path[depth] = node;
+    dir[depth] = (pos > 0);
+    depth++;
+
+    linkp = (pos < 0) ? &node->left : &node->right;
+    if (!*linkp) return -1;
+
+    node = node_private(tree, linkp);
+    if (!node) return -1;
+  }
+
+  if (tree->multi && (node_mult(node) > 1))
+  {
+      /*
+       * multiset: the key loses one occurrence but stays in the tree
+       */
+
+    node->size--;
+    for (i = 0; i < depth; i++) path[i]->size--;
+
+    if (tree->stats_on) tree->stats.deletes++;
+
+    return 0;
+  }
+
+  if (node->left && node->right)
+  {
+      /*
+       * node with two children: splice the in-order successor (smallest
+       * in the right subtree) into the victim's place, keeping its path
+       * on the stack for the retrace
+       */
+
+    vdepth = depth;
+    path[depth] = node;
+    dir[depth] = 1;
+    depth++;
+
+    linkp = &node->right;
+    succ = node_private(tree, linkp);
+    if (!succ) return -1;
+    while (succ->left)
+    {
+      path[depth] = succ;
+      dir[depth] = 0;
+      depth++;
+      linkp = &succ->left;
+      succ = node_private(tree, linkp);
+      if (!succ) return -1;
+    }
+
+      /*
+       * the spine between victim and successor loses the successor's
+       * whole occurrence count, not just one (multiset trees)
+       */
+
+    spine_dec = node_mult(succ);
+
+    if (path[depth - 1] == node) node->right = succ->right;
+    else
+    {
+      path[depth - 1]->left = succ->right;
+      if (succ->right) succ->right->parent = path[depth - 1];
+    }
+
+    succ->left = node->left;
+    succ->right = node->right;
+    succ->height = node->height;
+    succ->size = node->size;
+    if (succ->left) succ->left->parent = succ;
+    if (succ->right) succ->right->parent = succ;
+
+    path[vdepth] = succ;
+    if (vdepth == 0)
+    {
+      *rootp = succ;
+      succ->parent = NULL;
+    }
+    else
+    {
+      succ->parent = path[vdepth - 1];
+      if (dir[vdepth - 1]) path[vdepth - 1]->right = succ;
+      else path[vdepth - 1]->left = succ;
+    }
+  }
+  else
+  {
+      /*
+       * node with zero or one child: lift the child into its place
+       */
+
+    child = node->left ? node->left : node->right;
+    if (child) child->parent = depth ? path[depth - 1] : NULL;
+
+    if (depth == 0) *rootp = child;
+    else if (dir[depth - 1]) path[depth - 1]->right = child;
+    else path[depth - 1]->left = child;
+
+    vdepth = depth;
+  }
+
+  _avl_node_release(tree, node);
+
+    /*
+     * Every node on the path to the removed position loses one
+     * descendant; the spine between a spliced victim and its successor
+     * instead loses the successor's whole occurrence count, since the
+     * successor node moved out of those sub-trees
+     */
+
+  for (i = 0; i < depth; i++)
+    path[i]->size -= (i > vdepth) ? spine_dec : 1;
+
+    /*
+     * Retrace toward the root; unlike insertion a deletion can require a
+     * rotation at every level, but the retrace still stops the moment a
+     * sub-tree comes out of a step at its old height
+     */
+
+  while (depth-- > 0)
+  {
+    node = path[depth];
+    old_height = node->height;
+
+    if (tree->stats_on) tree->stats.delete_retrace_total++;
+
+    balance = avl_get_balance(node);
+
+    if ((balance <= 1) && (balance >= -1))
+    {
+      new_height = 1 + max(height(node->left), height(node->right));
+      if (new_height == old_height) break;
+      node->height = new_height;
+      continue;
+    }
+
+    if (balance > 1)
+    {
+        /*
+         * left-left or left-right, by the left child's balance; the
+         * rotated children may sit off the descent path, so they are
+         * made private here before being relinked
+         */
+
+      if (!node_private(tree, &node->left)) break;
+      if (avl_get_balance(node->left) < 0)
+      {
+        if (!node_private(tree, &node->left->right)) break;
+        node->left = avl_rotate_left(node->left);
+        if (tree->stats_on) tree->stats.rotations++;
+      }
+      sub = avl_rotate_right(node);
+    }
+    else
+    {
+        /*
+         * right-right or right-left, by the right child's balance
+         */
+
+      if (!node_private(tree, &node->right)) break;
+      if (avl_get_balance(node->right) > 0)
+      {
+        if (!node_private(tree, &node->right->left)) break;
+        node->right = avl_rotate_right(node->right);
+        if (tree->stats_on) tree->stats.rotations++;
+      }
+      sub = avl_rotate_left(node);
+    }
+
+    if (tree->stats_on) tree->stats.rotations++;
+
+    if (depth == 0) *rootp = sub;
+    else if (dir[depth - 1]) path[depth - 1]->right = sub;
+    else path[depth - 1]->left = sub;
+
+    if (sub->height == old_height) break;
+  }
+
+  if (tree->stats_on) tree->stats.deletes++;
+
+  return 0;
+}
+
+  /**
+   *  @fn avl_node *_avl_find(avl *tree, avl_node *target)
+   *
+   *  @brief find node in @p tree that matches key in @p target
+   *
+   *  @param tree - pointer to @a avl struct to search
+   *  @param target - pointer to @a avl_node containing key to match
+   *
+   *  @return pointer to @a avl_node that matches @p target, or NULL if no match is found
+   */
+
+static avl_node *_avl_find(avl *tree, avl_node *target)
+{
+  avl_node *node;
+  size_t depth = 0;
+  int pos;
+
+  if (!tree || !target || !tree_has_cmp(tree)) return NULL;
+
+  node = tree->root;
+  while (node)
+  {
+    AVL_PREFETCH(node->left);
+    AVL_PREFETCH(node->right);
+    depth++;
+    pos = node_cmp(tree, target, node);
+    if (pos == 0) break;
+    node = (pos < 0) ? node->left : node->right;
+  }
+
+  if (tree->stats_on && !tree->lock)
+  {
+    tree->stats.finds++;
+    tree->stats.find_depth_total += depth;
+    if (depth > tree->stats.find_depth_max)
+      tree->stats.find_depth_max = depth;
+  }
+
+  return node;
+}
+
+  /**
+   *  @fn void _avl_destroy(avl *tree)
+   *
+   *  @brief destroy an entire AVL tree
+   *
+   *  Releases every node in O(n) without calling the comparator or
+   *  rebalancing: any node with a left child is rotated (link-wise only,
+   *  heights are about to die anyway) until the root has none, then the
+   *  root is released and its right child takes its place.
+   *
+   *  @param tree - pointer to @a avl struct whose nodes are destroyed
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+static void _avl_destroy(avl *tree)
+{
+  avl_node *root, *left;
+
+  if (!tree || !tree->root) return;
+
+  root = tree->root;
+  while (root)
+  {
+    if (root->left)
+    {
+      left = root->left;
+      root->left = left->right;
+      left->right = root;
+      root = left;
+    }
+    else
+    {
+      left = root->right;
+      _avl_node_release(tree, root);
+      root = left;
+    }
+  }
+
+  tree->root = NULL;
+  tree->height = 0;
+}
+
+  /**
+   *  @fn void _avl_walk(avl_node *root, avl_order order, avl_action action)
+   *
+   *  @brief walk an AVL tree, in requested order
+   *
+   *  The walk stops early as soon as @p action returns non-zero.
+   *
+   *  @param root - pointer to @a avl_node that is root of tree
+   *  @param order - @a avl_order traversal order of nodes in tree
+   *  @param action - function that gets called for each traversed node
+   *
+   *  @par Returns
+   *    Nothing.
+   */
+
+static void _avl_walk(avl_node *root, avl_order order, avl_action action)
+{
+  if (!root) return;
+
+  switch (order)
+  {
+    case avl_forward_order: forward_order(root, action); break;
+    case avl_reverse_order: reverse_order(root, action); break;
+    case avl_pre_order: pre_order(root, action); break;
+    case avl_post_order: post_order(root, action); break;
+    case avl_tree_order: tree_order(root, action); break;
+  }
+}
+
+  /**
+   *  @fn int range_walk(avl *tree,
+   *                     avl_node *node,
+   *                     avl_node *lo,
+   *                     avl_node *hi,
+   *                     avl_action action)
+   *
+   *  @brief in-order walk of the nodes under @p node with keys in
+   *         [@p lo, @p hi], pruning sub-trees outside the range
+   *
+   *  @param tree - pointer to @a avl struct being walked
+   *  @param node - pointer to @a avl_node at root of sub-tree
+   *  @param lo - pointer to AVL NODE carrying the lower bound key, or NULL
+   *  @param hi - pointer to AVL NODE carrying the upper bound key, or NULL
+   *  @param action - function that gets called for each node in range
+   *
+   *  @return non-zero when @p action requested an early stop
+   */
+
+static int range_walk(avl *tree,
+                      avl_node *node,
+                      avl_node *lo,
+                      avl_node *hi,
+                      avl_action action)
+{
+  if (!node) return 0;
+
+    /*
+     * node below the range: everything left of it is too
+     */
+
+  if (lo && (node_cmp(tree, lo, node) > 0))
+    return range_walk(tree, node->right, lo, hi, action);
+
+    /*
+     * node above the range: everything right of it is too
+     */
+
+  if (hi && (node_cmp(tree, hi, node) < 0))
+    return range_walk(tree, node->left, lo, hi, action);
+
+  if (range_walk(tree, node->left, lo, hi, action)) return 1;
+  if (action(node)) return 1;
+  return range_walk(tree, node->right, lo, hi, action);
+}
+
+  /*
+   *
+   * Determines height of tree below node
+   *
+   */
+
+  /**
+   *  @fn int height(avl_node *n)
+   *
+   *  @brief calculate height of tree at node @p n
+   *
+   *  @param n - pointer to node in tree
+   *
+   *  @return height of tree at node @p n
+   */
+
+static int height(avl_node *n)
+{
+  if (!n) return 0;
+  return n->height;
+}
+
+  /**
+   *  @fn size_t node_size(avl_node *n)
+   *
+   *  @brief number of nodes in the sub-tree rooted at @p n
+   *
+   *  @param n - pointer to node in tree, may be NULL
+   *
+   *  @return sub-tree node count, 0 for NULL
+   */
+
+static size_t node_size(avl_node *n)
+{
+  if (!n) return 0;
+  return n->size;
+}
+
+  /**
+   *  @fn size_t node_mult(avl_node *n)
+   *
+   *  @brief number of occurrences the node itself accounts for
+   *
+   *  Derived from the sub-tree counters rather than stored: a node's
+   *  own multiplicity is its size minus its children's.  1 everywhere
+   *  except on multiset trees.
+   *
+   *  @param n - pointer to node in tree
+   *
+   *  @return occurrence count of the node's key
+   */
+
+static size_t node_mult(avl_node *n)
+{
+  return n->size - node_size(n->left) - node_size(n->right);
+}
+
+  /**
+   *  @fn int max(int a, int b)
+   *
+   *  @brief return maximum of two integers
+   *
+   *  @param a - first integer
+   *  @param b - second integer
+   *
+   *  @return maximum of a or b
+   */
+
+static int max(int a, int b) { return (a > b) ? a : b; }
+
+  /**
+   *  @fn avl_node *avl_rotate_right(avl_node *y)
+   *
+   *  @brief right rotate subtree rooted at @p y
+   *
+   *  @param y - pointer to @a avl_node in tree
+   *
+   *  @return pointer to @a avl_node that is new root at @p y
+   */
+
+static avl_node *avl_rotate_right(avl_node *y)
+{
+  avl_node *x = y->left;
+  avl_node *T2 = x->right;
+
+    // Capture own multiplicities before the links move (multiset trees
+    // store occurrence counts inside the size counters)
+  size_t my = node_mult(y);
+  size_t mx = node_mult(x);
+
+    // Perform rotation
+  x->right = y;
+  y->left = T2;
+
+    // Update parent links; x takes y's old place
+  x->parent = y->parent;
+  y->parent = x;
+  if (T2) T2->parent = y;
+
+    // Update heights and sub-tree sizes
+  y->height = max(height(y->left), height(y->right))+1;
+  x->height = max(height(x->left), height(x->right))+1;
+  y->size = node_size(y->left) + node_size(y->right) + my;
+  x->size = node_size(x->left) + node_size(x->right) + mx;
+
+    // Return new root
+  return x;
+}
+
+  /**
+   *  @fn avl_node *avl_rotate_left(avl_node *x)
+   *
+   *  @brief left rotate subtree rooted at @p x
+   *
+   *  @param x - pointer to @a avl_node in tree
+   *
+   *  @return pointer to @a avl_node that is new root at @p x
+   */
+
+static avl_node *avl_rotate_left(avl_node *x)
+{
+  avl_node *y = x->right;
+  avl_node *T2 = y->left;
+
+    // Capture own multiplicities before the links move (multiset trees
+    // store occurrence counts inside the size counters)
+  size_t mx = node_mult(x);
+  size_t my = node_mult(y);
+
+    // Perform rotation
+  y->left = x;
+  x->right = T2;
+
+    // Update parent links; y takes x's old place
+  y->parent = x->parent;
+  x->parent = y;
+  if (T2) T2->parent = x;
+
+    // Update heights and sub-tree sizes
+  x->height = max(height(x->left), height(x->right))+1;
+  y->height = max(height(y->left), height(y->right))+1;
+  x->size = node_size(x->left) + node_size(x->right) + mx;
+  y->size = node_size(y->left) + node_size(y->right) + my;
+
+    // Return new root
+  return y;
+}
+
+  /**
+   *  @fn int avl_get_balance(avl_node *n)
+   *
+   *  @brief returns balance factor of @p n
+   *
+   *  The balance factor is the difference of the sub-tree height on the left side of @p n
+   *  and the right side of @p n.
+   *
+   *  @param n - pointer to @a avl_node in tree
+   *
+   *  @return balance factor
+   */
+
+static int avl_get_balance(avl_node *n)
+{
+  if (!n) return 0;
+  return height(n->left) - height(n->right);
+}
+
+  /**
+   *  @fn int pre_order(avl_node *root, avl_action action)
+   *
+   *  @brief Walk the sub-tree under @p n in pre-order: root-left-right
+   *
+   *  @param root - pointer to @a avl_node in tree
+   *  @param action - pointer to function that gets called at each node
+   *
+   *  @return non-zero when @p action requested an early stop
+   */
+
+static int pre_order(avl_node *root, avl_action action)
+{
+  if (!root || !action) return 0;
+
+  if (action(root)) return 1;
+  if (pre_order(root->left, action)) return 1;
+  return pre_order(root->right, action);
+}
+
+  /**
+   *  @fn int forward_order(avl_node *root, avl_action action)
+   *
+   *  @brief Walk the sub-tree under @p n in forward-order: left-root-right
+   *
+   *  @param root - pointer to @a avl_node in tree
+   *  @param action - pointer to function that gets called at each node
+   *
+   *  @return non-zero when @p action requested an early stop
+   */
+
+static int forward_order(avl_node *root, avl_action action)
+{
+  if (!root || !action) return 0;
+
+  if (root->left && forward_order(root->left, action)) return 1;
+  if (action(root)) return 1;
+  if (root->right && forward_order(root->right, action)) return 1;
+
+  return 0;
+}
+
+  /**
+   *  @fn int reverse_order(avl_node *root, avl_action action)
+   *
+   *  @brief Walk the sub-tree under @p n in reverse-order: right-root-left
+   *
+   *  @param root - pointer to @a avl_node in tree
+   *  @param action - pointer to function that gets called at each node
+   *
+   *  @return non-zero when @p action requested an early stop
+   */
+
+static int reverse_order(avl_node *root, avl_action action)
+{
+  if (!root || !action) return 0;
+
+  if (root->right && reverse_order(root->right, action)) return 1;
+  if (action(root)) return 1;
+  if (root->left && reverse_order(root->left, action)) return 1;
+
+  return 0;
+}
+
+  /**
+   *  @fn int post_order(avl_node *root, avl_action action)
+   *
+   *  @brief Walk the sub-tree under @p n in post-order: left-right-root
+   *
+   *  @param root - pointer to @a avl_node in tree
+   *  @param action - pointer to function that gets called at each node
+   *
+   *  @return non-zero when @p action requested an early stop
+   */
+
+static int post_order(avl_node *root, avl_action action)
+{
+  if (!root || !action) return 0;
+
+  if (post_order(root->left, action)) return 1;
+  if (post_order(root->right, action)) return 1;
+  return action(root) ? 1 : 0;
+}
+
+  /**
+   *  @fn int tree_order(avl_node *root, avl_action action)
+   *
+   *  @brief Walk the sub-tree under @p n in tree-order, AKA level-order:
+   *    level1-level2-...-levelN
+   *
+   *  A breadth-first pass over a ring buffer of node pointers: each node
+   *  is visited exactly once, in true level order by depth from the
+   *  root.  The ring holds at most one level of the tree plus one node
+   *  and doubles (unwrapping in the copy) when a level outgrows it.
+   *
+   *  @param root - pointer to @a avl_node in tree
+   *  @param action - pointer to function that gets called at each node
+   *
+   *  @return non-zero when @p action requested an early stop
+   */
+
+static int tree_order(avl_node *root, avl_action action)
+{
+  avl_node **ring, **bigger;
+  size_t cap, head, count, i;
+  avl_node *node;
+  int rv = 0;
+
+  if (!root || !action) return 0;
+
+  cap = 256;
+  ring = malloc(cap * sizeof(avl_node *));
+  if (!ring) return 0;
+
+  head = 0;
+  count = 0;
+  ring[(head + count++) % cap] = root;
+
+  while (count)
+  {
+    node = ring[head];
+    head = (head + 1) % cap;
+    count--;
+
+    if (action(node))
+    {
+      rv = 1;
+      break;
+    }
+
+    if (count + 2 > cap)
+    {
+      bigger = malloc(cap * 2 * sizeof(avl_node *));
+      if (!bigger) break;
+      for (i = 0; i < count; i++) bigger[i] = ring[(head + i) % cap];
+      free(ring);
+      ring = bigger;
+      head = 0;
+      cap *= 2;
+    }
+
+    if (node->left) ring[(head + count++) % cap] = node->left;
+    if (node->right) ring[(head + count++) % cap] = node->right;
   }
 
-exit:
+  free(ring);
+
   return rv;
 }
 
   /**
-   *  @fn avl_node *avl_find(avl *tree, avl_node *target)
+   *  @fn void iter_push_spine(avl_iter *iter, avl_node *node)
    *
-   *  @brief searches @p tree for @p target
+   *  @brief push a node and its descent spine onto a cursor's stack
    *
-   *  @param tree - pointer to existing AVL tree
-   *  @param target - pointer to AVL NODE to search for
+   *  For a forward cursor the left spine is pushed (the deepest entry is
+   *  the smallest pending node); for a reverse cursor, the right spine.
    *
-   *  @return pointer to @a avl_node on success, NULL on failure
+   *  @param iter - pointer to open @a avl_iter
+   *  @param node - pointer to @a avl_node to descend from, may be NULL
+   *
+   *  @par Returns
+   *       Nothing.
    */
 
-avl_node *avl_find(avl *tree, avl_node *target)
+static void iter_push_spine(avl_iter *iter, avl_node *node)
 {
-  avl_node *node = NULL;
-
-  if (!tree || !target) goto exit;
-
-  node = _avl_find(tree->root, target, tree->cmp_node);
-
-exit:
-  return node;
+  while (node)
+  {
+    iter->path[iter->depth++] = node;
+    node = (iter->order == avl_forward_order) ? node->left : node->right;
+  }
 }
 
   /**
-   *  @fn void avl_walk(avl *tree, avl_order order, avl_action action)
+   *  @fn void walk_collect(avl_node *node,
+   *                        int level,
+   *                        avl_node **skeleton,
+   *                        size_t *nskel,
+   *                        avl_node **tasks,
+   *                        size_t *ntasks)
    *
-   *  @brief walk an AVL tree in requested order calling @p action on each node
+   *  @brief record the top @p level levels as skeleton nodes and the
+   *         sub-trees hanging below them as traversal tasks
    *
-   *  @param tree - pointer to @a avl struct
-   *  @param order - @a avl_order; traversal order of nodes in tree
-   *  @param action - function that gets called for each encountered node
+   *  @param node - pointer to @a avl_node at root of sub-tree
+   *  @param level - number of levels left to treat as skeleton
+   *  @param skeleton - skeleton node array being filled, parent-first
+   *  @param nskel - number of skeleton nodes so far
+   *  @param tasks - task array being filled
+   *  @param ntasks - number of tasks so far
    *
    *  @par Returns
-   *    Nothing.
+   *       Nothing.
    */
 
-void avl_walk(avl *tree, avl_order order, avl_action action)
+static void walk_collect(avl_node *node,
+                         int level,
+                         avl_node **skeleton,
+                         size_t *nskel,
+                         avl_node **tasks,
+                         size_t *ntasks)
 {
-  if (!tree || !action) goto exit;
+  if (!node) return;
 
-  _avl_walk(tree->root, order, action);
+  if (level == 0)
+  {
+    tasks[(*ntasks)++] = node;
+    return;
+  }
 
-exit:
-  return;
+  skeleton[(*nskel)++] = node;
+
+  walk_collect(node->left, level - 1, skeleton, nskel, tasks, ntasks);
+  walk_collect(node->right, level - 1, skeleton, nskel, tasks, ntasks);
 }
 
   /**
-   *  @fn void avl_set_new(avl *tree, avl_new_node new_node)
+   *  @fn void *walk_worker(void *arg)
    *
-   *  @brief sets function used by @p tree for created a new @a avl_node
+   *  @brief worker thread body for avl_walk_parallel()
    *
-   *  @param tree - pointer to @a avl struct
-   *  @param new_node - function that creates a new @a avl_node for this tree
+   *  @param arg - pointer to this worker's @a walk_worker_args
    *
-   *  @par Returns
-   *    Nothing.
+   *  @return NULL
    */
 
-void avl_set_new(avl *tree, avl_new_node new_node)
+static void *walk_worker(void *arg)
 {
-  if (tree) tree->new_node = new_node;
+  walk_worker_args *args = arg;
+  size_t i;
+
+  for (i = args->start; i < args->ntasks; i += args->stride)
+  {
+    if (args->order == avl_pre_order) pre_order(args->tasks[i], args->action);
+    else post_order(args->tasks[i], args->action);
+  }
+
+  return NULL;
 }
 
   /**
-   *  @fn void avl_set_dup(avl *tree, avl_dup_node dup_node)
+   *  @fn void tree_rdlock(avl *tree)
    *
-   *  @brief sets function used by @p tree for duplicating an @a avl_node
+   *  @brief take a tree's read lock; no-op for non-concurrent trees
    *
    *  @param tree - pointer to @a avl struct
-   *  @param dup_node - function that duplicates an @a avl_node for this tree
    *
    *  @par Returns
-   *    Nothing.
+   *       Nothing.
    */
 
-void avl_set_dup(avl *tree, avl_dup_node dup_node)
+static void tree_rdlock(avl *tree)
 {
-  if (tree) tree->dup_node = dup_node;
+  if (tree && tree->lock) pthread_rwlock_rdlock(&tree->lock->rw);
 }
 
   /**
-   *  @fn void avl_set_free(avl *tree, avl_free_node free_node)
+   *  @fn void tree_wrlock(avl *tree)
    *
-   *  @brief sets function used by @p tree for freeing an @a avl_node
+   *  @brief take a tree's write lock; no-op for non-concurrent trees
    *
    *  @param tree - pointer to @a avl struct
-   *  @param free_node - function that frees an @a avl_node for this tree
    *
    *  @par Returns
-   *    Nothing.
+   *       Nothing.
    */
 
-void avl_set_free(avl *tree, avl_free_node free_node)
+static void tree_wrlock(avl *tree)
 {
-  if (tree) tree->free_node = free_node;
+  if (tree && tree->lock) pthread_rwlock_wrlock(&tree->lock->rw);
 }
 
   /**
-   *  @fn void avl_set_cmp(avl *tree, avl_cmp_node cmp_node)
+   *  @fn void tree_unlock(avl *tree)
    *
-   *  @brief sets function used by @p tree for comparing two @a avl_node
+   *  @brief release a tree's lock; no-op for non-concurrent trees
    *
    *  @param tree - pointer to @a avl struct
-   *  @param cmp_node - function that compares two @a avl_node for this tree
    *
    *  @par Returns
-   *    Nothing.
+   *       Nothing.
    */
 
-void avl_set_cmp(avl *tree, avl_cmp_node cmp_node)
+static void tree_unlock(avl *tree)
 {
-  if (tree) tree->cmp_node = cmp_node;
+  if (tree && tree->lock) pthread_rwlock_unlock(&tree->lock->rw);
 }
 
-      /*
-       *  AVL NODE functions
-       */
-
   /**
-   *  @fn avl_node *avl_node_new(avl *tree, void *value)
+   *  @fn int node_cmp(const avl *tree, avl_node *a, avl_node *b)
    *
-   *  @brief creates a new @a avl_node
+   *  @brief compare two nodes by the tree's key flavor
    *
-   *  @param tree - pointer to existing AVL tree
-   *  @param value - pointer to payload that is attached to the node
+   *  For the built-in flavors the comparison happens inline here - one
+   *  predictable switch instead of an indirect call per level; the
+   *  custom flavor dispatches to the user's cmp_node function.
    *
-   *  @return pointer to @a avl_node on success, NULL on failure
+   *  @param tree - pointer to @a avl struct that owns the nodes
+   *  @param a - pointer to existing AVL NODE struct
+   *  @param b - pointer to existing AVL NODE struct
+   *
+   *  @return negative if a<b, 0 if a==b, positive if a>b
    */
 
-avl_node *avl_node_new(avl *tree, void *value)
+static int node_cmp(avl *tree, avl_node *a, avl_node *b)
 {
-  avl_node *node = NULL;
-
-  if (!tree) goto exit;
+  if (tree->stats_on && !tree->lock) tree->stats.compares++;
 
-  if (tree->new_node) node = tree->new_node();
-  else node = _avl_node_new(value);
-
-exit:
-  return node;
+  switch (tree->key_kind)
+  {
+    case avl_key_i64:
+    {
+      intptr_t x = (intptr_t)a->value, y = (intptr_t)b->value;
+      return (x > y) - (x < y);
+    }
+    case avl_key_u64:
+    {
+      uintptr_t x = (uintptr_t)a->value, y = (uintptr_t)b->value;
+      return (x > y) - (x < y);
+    }
+    case avl_key_str:
+      return strcmp(a->value, b->value);
+    case avl_key_mem:
+      return memcmp(a->value, b->value, tree->key_len);
+    default:
+      return tree->cmp_node(a, b);
+  }
 }
 
   /**
-   *  @fn avl_node *avl_node_dup(avl *tree, avl_node *node)
+   *  @fn int key_cmp(const avl *tree, const void *key, avl_node *n)
    *
-   *  @brief duplicates an @a avl_node
+   *  @brief compare a bare key to a node by the tree's key flavor
    *
-   *  @param tree - pointer to existing AVL tree
-   *  @param node - pointer to existing AVL NODE struct
+   *  @param tree - pointer to @a avl struct that owns the node
+   *  @param key - bare key
+   *  @param n - pointer to existing AVL NODE struct
    *
-   *  @return pointer to @a avl_node on success, NULL on failure
+   *  @return negative if key<n, 0 if key==n, positive if key>n
    */
 
-avl_node *avl_node_dup(avl *tree, avl_node *node)
+static int key_cmp(avl *tree, const void *key, avl_node *n)
 {
-  avl_node *new_node = NULL;
-
-  if (!tree || !node) goto exit;
+  if (tree->stats_on && !tree->lock) tree->stats.compares++;
 
-  if (tree->dup_node) new_node = tree->dup_node(node);
-  else
+  switch (tree->key_kind)
   {
-    new_node = _avl_node_new(NULL);
-    if (!new_node) goto exit;
-    new_node->value = node->value;
+    case avl_key_i64:
+    {
+      intptr_t x = (intptr_t)key, y = (intptr_t)n->value;
+      return (x > y) - (x < y);
+    }
+    case avl_key_u64:
+    {
+      uintptr_t x = (uintptr_t)key, y = (uintptr_t)n->value;
+      return (x > y) - (x < y);
+    }
+    case avl_key_str:
+      return strcmp(key, n->value);
+    case avl_key_mem:
+      return memcmp(key, n->value, tree->key_len);
+    default:
+      return tree->cmp_key(key, n);
   }
-
-exit:
-  return new_node;
 }
 
   /**
-   *  @fn void avl_node_free(avl *tree, avl_node *node)
+   *  @fn int tree_has_cmp(const avl *tree)
    *
-   *  @brief frees memory allocated to @p node
+   *  @brief whether node comparisons are possible on @p tree
    *
-   *  @param tree - pointer to existing AVL tree
-   *  @param node - pointer to existing AVL NODE struct
+   *  @param tree - pointer to @a avl struct
    *
-   *  @par Returns
-   *       Nothing.
+   *  @return non-zero when a built-in flavor or a cmp_node function is set
    */
 
-void avl_node_free(avl *tree, avl_node *node)
+static int tree_has_cmp(const avl *tree)
 {
-  if (!tree || !node) return;
+  return (tree->key_kind != avl_key_custom) || (tree->cmp_node != NULL);
+}
 
-  if (tree->free_node) tree->free_node(node);
-  else free(node);
+  /**
+   *  @fn int tree_has_key_cmp(const avl *tree)
+   *
+   *  @brief whether bare-key comparisons are possible on @p tree
+   *
+   *  @param tree - pointer to @a avl struct
+   *
+   *  @return non-zero when a built-in flavor or a cmp_key function is set
+   */
+
+static int tree_has_key_cmp(const avl *tree)
+{
+  return (tree->key_kind != avl_key_custom) || (tree->cmp_key != NULL);
 }
 
   /**
-   *  @fn int avl_node_cmp(avl *tree, avl_node *a, avl_node *b)
+   *  @fn int cmp_i64_node(avl_node *a, avl_node *b)
    *
-   *  @brief compares @p a and @p b
+   *  @brief generic-slot comparator matching the avl_key_i64 flavor
    *
-   *  @param tree - pointer to existing AVL tree
    *  @param a - pointer to existing AVL NODE struct
    *  @param b - pointer to existing AVL NODE struct
    *
    *  @return -1 if a<b, 0 if a==b, 1 if a>b
    */
 
-int avl_node_cmp(avl *tree, avl_node *a, avl_node *b)
+static int cmp_i64_node(avl_node *a, avl_node *b)
 {
-  if (!tree || !a || !b) return 0;
-  if (!tree->cmp_node) return 0;
+  intptr_t x = (intptr_t)a->value, y = (intptr_t)b->value;
 
-  return tree->cmp_node(a, b);
+  return (x > y) - (x < y);
 }
 
-    /*
-     * private functions
-     */
-
   /**
-   *  @fn avl_node *_avl_insert(avl_node *node,
-   *                            avl_node *item,
-   *                            int (*compare)(avl_node *a, avl_node *b))
+   *  @fn int cmp_u64_node(avl_node *a, avl_node *b)
    *
-   *  @brief Insert a node into the subtree rooted with node
+   *  @brief generic-slot comparator matching the avl_key_u64 flavor
    *
-   *  @param node - pointer to existing @a avl_node, root of insertion point
-   *  @param item - pointer to existing @a avl_node, new node to insert
-   *  @param compare - comparison function used to determine order of two nodes
+   *  @param a - pointer to existing AVL NODE struct
+   *  @param b - pointer to existing AVL NODE struct
    *
-   *  @return pointer to new root of subtree
+   *  @return -1 if a<b, 0 if a==b, 1 if a>b
    */
 
-static avl_node *_avl_insert(avl_node *node,
-                             avl_node *item,
-                             int (*compare)(avl_node *a, avl_node *b))
+static int cmp_u64_node(avl_node *a, avl_node *b)
 {
-  int pos = 0;
-
-    /*
-     * Perform the normal BST insertion
-     */
-
-  if (!node) return(item);
-  if (!item) return node;
-
-  pos = compare(item, node);
-
-  if (pos < 0) node->left = _avl_insert(node->left, item, compare);
-  else if (pos > 0) node->right = _avl_insert(node->right, item, compare);
-  else return node;
-
-    /*
-     * Update height of this ancestor node
-     */
-
-  node->height = 1 + max(height(node->left), height(node->right));
-
-    /*
-     * Get the balance factor of this ancestor node
-     */
-
-  int balance = avl_get_balance(node);
-
-    /*
-     * If this node becomes unbalanced, then there are 4 cases
-     */
-
-      /*
-       * Left Left Case
-       */
-
-  if ((balance > 1) && (compare(item, node->left) < 0))
-    return avl_rotate_right(node);
-
-      /*
-       * Right Right Case
-       */
-
-  if ((balance < -1) && (compare(item, node->right) > 0))
-    return avl_rotate_left(node);
-
-      /*
-       * Left Right Case
-       */
-
-  if ((balance > 1) && (compare(item, node->left) > 0))
-  {
-    node->left = avl_rotate_left(node->left);
-    return avl_rotate_right(node);
-  }
-
-      /*
-       * Right Left Case
-       */
-
-  if ((balance < -1) && (compare(item, node->right) < 0))
-  {
-    node->right = avl_rotate_right(node->right);
-    return avl_rotate_left(node);
-  }
-
-    /*
-     * return the (unchanged) node pointer
-     */
+  uintptr_t x = (uintptr_t)a->value, y = (uintptr_t)b->value;
 
-  return node;
+  return (x > y) - (x < y);
 }
 
   /**
-   *  @fn avl_node *_avl_delete(avl_node *root,
-   *                            avl_node *target,
-   *                            int (*compare)(avl_node *a, avl_node *b),
-   *                            void (*free_node)(avl_node *n))
+   *  @fn int cmp_str_node(avl_node *a, avl_node *b)
    *
-   *  @brief deletes a node with given key given root to delete from
+   *  @brief generic-slot comparator matching the avl_key_str flavor
    *
-   *  @param root - pointer to @a avl_node which is root of tree to delete from
-   *  @param target - pointer to @a avl_node containing target key to delete
-   *  @param compare - comparison function used to determine order of two nodes
-   *  @param free_node - function used to free memory allocated to deleted node
+   *  @param a - pointer to existing AVL NODE struct
+   *  @param b - pointer to existing AVL NODE struct
    *
-   *  @return pointer to new root of subtree
+   *  @return negative if a<b, 0 if a==b, positive if a>b
    */
 
-static avl_node *_avl_delete(avl_node *root,
-                             avl_node *target,
-                             int (*compare)(avl_node *a, avl_node *b),
-                             void (*free_node)(avl_node *n))
+static int cmp_str_node(avl_node *a, avl_node *b)
 {
-  int pos = 0;
-  void *root_val;
-  avl_node *child, temp;
-
-    /*
-     * Standard BST delete
-     */
-
-  if (!root || !target || !compare) return root;
-
-  pos = compare(target, root);
-
-  if (pos < 0)
-    root->left = _avl_delete(root->left, target, compare, free_node);
-  else if(pos > 0)
-    root->right = _avl_delete(root->right, target, compare, free_node);
-  else
-  {
-      /*
-       * node with zero or one child
-       */
-
-    if((root->left == NULL) || (root->right == NULL))
-    {
-      child = root->left ? root->left : root->right;
-      if (child)
-      {
-        temp = *root;
-        *root = *child;
-        *child = temp;
-      }
-      if (!child)
-      {
-        child = root;
-        root = NULL;
-      }
-      if (free_node) free_node(child);
-      else free(child);
-    }
-
-      /*
-       * node with two children
-       */
-
-    else
-    {
-        /*
-         * get the inorder successor (smallest in the right subtree)
-         */
-
-      avl_node* temp = minimum_node(root->right);
-
-        /*
-         * copy the inorder successor's data to this node
-         */
-
-      root_val = root->value;
-      root->value = temp->value;
-      temp->value = root_val;
-
-        /*
-         * delete the inorder successor
-         */
-
-      root->right = _avl_delete(root->right, temp, compare, free_node);
-    }
-  }
-
-    /*
-     * If the tree had only one node then return
-     */
-
-  if (root == NULL) return root;
-
-    /*
-     * Update the height of the current tree
-     */
-
-  root->height = 1 + max(height(root->left), height(root->right));
-
-    /*
-     * Get balance of this node
-     */
-
-  int balance = avl_get_balance(root);
-
-      /*
-       * If this node becomes unbalanced, then there are 4 cases
-       */
-
-    /*
-     * left-left
-     */
+  return strcmp(a->value, b->value);
+}
 
-  if (balance > 1 && avl_get_balance(root->left) >= 0)
-    return avl_rotate_right(root);
+  /**
+   *  @fn int cmp_i64_key(const void *key, avl_node *n)
+   *
+   *  @brief generic-slot key comparator matching the avl_key_i64 flavor
+   *
+   *  @param key - bare key
+   *  @param n - pointer to existing AVL NODE struct
+   *
+   *  @return -1 if key<n, 0 if key==n, 1 if key>n
+   */
 
-    /*
-     * left-right
-     */
+static int cmp_i64_key(const void *key, avl_node *n)
+{
+  intptr_t x = (intptr_t)key, y = (intptr_t)n->value;
 
-  if (balance > 1 && avl_get_balance(root->left) < 0)
-  {
-    root->left = avl_rotate_left(root->left);
-    return avl_rotate_right(root);
-  }
+  return (x > y) - (x < y);
+}
 
-    /*
-     * right-right
-     */
+  /**
+   *  @fn int cmp_u64_key(const void *key, avl_node *n)
+   *
+   *  @brief generic-slot key comparator matching the avl_key_u64 flavor
+   *
+   *  @param key - bare key
+   *  @param n - pointer to existing AVL NODE struct
+   *
+   *  @return -1 if key<n, 0 if key==n, 1 if key>n
+   */
 
-  if (balance < -1 && avl_get_balance(root->right) <= 0)
-    return avl_rotate_left(root);
+static int cmp_u64_key(const void *key, avl_node *n)
+{
+  uintptr_t x = (uintptr_t)key, y = (uintptr_t)n->value;
 
-    /*
-     * right-left
-     */
+  return (x > y) - (x < y);
+}
 
-  if (balance < -1 && avl_get_balance(root->right) > 0)
-  {
-    root->right = avl_rotate_right(root->right);
-    return avl_rotate_left(root);
-  }
+  /**
+   *  @fn int cmp_str_key(const void *key, avl_node *n)
+   *
+   *  @brief generic-slot key comparator matching the avl_key_str flavor
+   *
+   *  @param key - bare key
+   *  @param n - pointer to existing AVL NODE struct
+   *
+   *  @return negative if key<n, 0 if key==n, positive if key>n
+   */
 
-  return root;
+static int cmp_str_key(const void *key, avl_node *n)
+{
+  return strcmp(key, n->value);
 }
 
   /**
-   *  @fn avl_node *_avl_find(avl_node *root,
-   *                          avl_node *target,
-   *                          int (*compare)(avl_node *a, avl_node *b))
+   *  @fn avl_node *node_private(avl *tree, avl_node **linkp)
    *
-   *  @brief find node in @p root that matches key in @p target
+   *  @brief make the node at @p linkp private to this tree version
    *
-   *  @param root - pointer to @a avl_node which is root of tree to search
-   *  @param target - pointer to @a avl_node containing key to match
-   *  @param compare - comparison function used to determine order of two nodes
+   *  No-op (and free) on non-persistent trees and on nodes only this
+   *  version references.  A shared node is replaced in place by a copy:
+   *  the copy takes over the children (bumping their reference counts)
+   *  and the original keeps serving the other versions.  Node payloads
+   *  are shared between the copies.
    *
-   *  @return pointer to @a avl_node that matches @p target, or NULL if no match is found
+   *  @param tree - pointer to @a avl struct that owns the link
+   *  @param linkp - address of the parent link to the node
+   *
+   *  @return pointer to the private node, or NULL on allocation failure
+   *          (or when the link is empty)
    */
 
-static avl_node *_avl_find(avl_node *root,
-                           avl_node *target,
-                           int (*compare)(avl_node *a, avl_node *b))
+static avl_node *node_private(avl *tree, avl_node **linkp)
 {
-  int pos = 0;
+  avl_node *node, *copy;
 
-  if (!root || !target) return NULL;
+  node = *linkp;
+  if (!node) return NULL;
+  if (!tree->persistent || (node->refs == 1)) return node;
 
-  pos = compare(target, root);
+  copy = _avl_node_new(tree, node->value);
+  if (!copy) return NULL;
 
-  if (pos == 0) return root;
-  if (pos < 0) return _avl_find(root->left, target, compare);
-  if (pos > 0) return _avl_find(root->right, target, compare);
+  copy->left = node->left;
+  copy->right = node->right;
+  copy->height = node->height;
+  copy->size = node->size;
 
-  return NULL;
+  if (copy->left) copy->left->refs++;
+  if (copy->right) copy->right->refs++;
+
+  node->refs--;
+  *linkp = copy;
+
+  return copy;
 }
 
   /**
-   *  @fn void _avl_destroy(avl_node *root,
-   *                        int (*compare)(avl_node *a, avl_node *b),
-   *                        void (*free_node)(avl_node *n))
+   *  @fn void release_version(avl *tree, avl_node *node)
    *
-   *  @brief destroy an entire AVL tree
+   *  @brief drop one version's reference to a sub-tree
    *
-   *  @param root - pointer to @a avl_node that is root of tree
-   *  @param compare - comparison function used to determine order of two nodes
-   *  @param free_node - function used to free memory allocated to deleted node
+   *  Recurses only into nodes whose last reference went away, so
+   *  freeing a snapshot costs O(nodes owned exclusively by it) and
+   *  leaves everything still shared untouched.
+   *
+   *  @param tree - pointer to @a avl struct being freed
+   *  @param node - pointer to root @a avl_node of sub-tree
    *
    *  @par Returns
-   *    Nothing.
+   *       Nothing.
    */
 
-static void _avl_destroy(avl_node *root,
-                         int (*compare)(avl_node *a, avl_node *b),
-                         void (*free_node)(avl_node *n))
+static void release_version(avl *tree, avl_node *node)
 {
-  if (!root) return;
+  if (!node) return;
 
-  while (root) root = _avl_delete(root, root, compare, free_node);
+  if (--node->refs) return;
+
+  release_version(tree, node->left);
+  release_version(tree, node->right);
+
+  if (tree->free_node) tree->free_node(node);
+  else free(node);
 }
 
   /**
-   *  @fn void _avl_walk(avl_node *root, avl_order order, avl_action action)
+   *  @fn int write_all(int fd, const void *data, size_t len)
    *
-   *  @brief walk an AVL tree, in requested order
+   *  @brief write @p len bytes to @p fd, riding out short writes
    *
-   *  @param root - pointer to @a avl_node that is root of tree
-   *  @param order - @a avl_order traversal order of nodes in tree
-   *  @param action - function that gets called for each traversed node
+   *  @param fd - writable file descriptor
+   *  @param data - bytes to write
+   *  @param len - number of bytes
    *
-   *  @par Returns
-   *    Nothing.
+   *  @return 0 on success, -1 on failure
    */
 
-static void _avl_walk(avl_node *root, avl_order order, avl_action action)
+static int write_all(int fd, const void *data, size_t len)
 {
-  if (!root) return;
+  const char *p = data;
+  ssize_t n;
 
-  switch (order)
+  while (len)
   {
-    case avl_forward_order: forward_order(root, action); break;
-    case avl_reverse_order: reverse_order(root, action); break;
-    case avl_pre_order: pre_order(root, action); break;
-    case avl_post_order: post_order(root, action); break;
-    case avl_tree_order: tree_order(root, action); break;
+    n = write(fd, p, len);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= (size_t)n;
   }
-}
 
-  /*
-   *
-   * Determines height of tree below node
-   *
-   */
+  return 0;
+}
 
   /**
-   *  @fn int height(avl_node *n)
+   *  @fn int read_all(int fd, void *data, size_t len)
    *
-   *  @brief calculate height of tree at node @p n
+   *  @brief read @p len bytes from @p fd, riding out short reads
    *
-   *  @param n - pointer to node in tree
+   *  @param fd - readable file descriptor
+   *  @param data - destination buffer
+   *  @param len - number of bytes
    *
-   *  @return height of tree at node @p n
+   *  @return 0 on success, -1 on failure
    */
 
-static int height(avl_node *n)
+static int read_all(int fd, void *data, size_t len)
 {
-  if (!n) return 0;
-  return n->height;
+  char *p = data;
+  ssize_t n;
+
+  while (len)
+  {
+    n = read(fd, p, len);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= (size_t)n;
+  }
+
+  return 0;
 }
 
   /**
-   *  @fn int max(int a, int b)
+   *  @fn int save_value_intrinsic(int fd, void *value)
    *
-   *  @brief return maximum of two integers
+   *  @brief default value serializer: the pointer bits as a 64-bit integer
    *
-   *  @param a - first integer
-   *  @param b - second integer
+   *  @param fd - writable file descriptor
+   *  @param value - node value
    *
-   *  @return maximum of a or b
+   *  @return 0 on success, -1 on failure
    */
 
-static int max(int a, int b) { return (a > b) ? a : b; }
+static int save_value_intrinsic(int fd, void *value)
+{
+  uint64_t bits = (uint64_t)(uintptr_t)value;
+
+  return write_all(fd, &bits, sizeof(bits));
+}
 
   /**
-   *  @fn avl_node *avl_rotate_right(avl_node *y)
+   *  @fn int load_value_intrinsic(int fd, void **value)
    *
-   *  @brief right rotate subtree rooted at @p y
+   *  @brief default value deserializer matching save_value_intrinsic()
    *
-   *  @param y - pointer to @a avl_node in tree
+   *  @param fd - readable file descriptor
+   *  @param value - receives the decoded value
    *
-   *  @return pointer to @a avl_node that is new root at @p y
+   *  @return 0 on success, -1 on failure
    */
 
-static avl_node *avl_rotate_right(avl_node *y)
+static int load_value_intrinsic(int fd, void **value)
 {
-  avl_node *x = y->left;
-  avl_node *T2 = x->right;
+  uint64_t bits;
 
-    // Perform rotation
-  x->right = y;
-  y->left = T2;
+  if (read_all(fd, &bits, sizeof(bits))) return -1;
 
-    // Update heights
-  y->height = max(height(y->left), height(y->right))+1;
-  x->height = max(height(x->left), height(x->right))+1;
+  *value = (void *)(uintptr_t)bits;
 
-    // Return new root
-  return x;
+  return 0;
 }
 
   /**
-   *  @fn avl_node *avl_rotate_left(avl_node *x)
+   *  @fn int save_subtree(avl_node *root, int fd, avl_value_save save_value)
    *
-   *  @brief left rotate subtree rooted at @p x
+   *  @brief write one sub-tree pre-order: flags byte, value, children
    *
-   *  @param x - pointer to @a avl_node in tree
+   *  @param root - pointer to @a avl_node at root of sub-tree
+   *  @param fd - writable file descriptor
+   *  @param save_value - value serializer
    *
-   *  @return pointer to @a avl_node that is new root at @p x
+   *  @return 0 on success, -1 on failure
    */
 
-static avl_node *avl_rotate_left(avl_node *x)
+static int save_subtree(avl_node *root, int fd, avl_value_save save_value)
 {
-  avl_node *y = x->right;
-  avl_node *T2 = y->left;
+  unsigned char flags;
 
-    // Perform rotation
-  y->left = x;
-  x->right = T2;
+  if (!root) return 0;
 
-    // Update heights
-  x->height = max(height(x->left), height(x->right))+1;
-  y->height = max(height(y->left), height(y->right))+1;
+  flags = (root->left ? 1 : 0) | (root->right ? 2 : 0);
 
-    // Return new root
-  return y;
+  if (write_all(fd, &flags, sizeof(flags))) return -1;
+  if (save_value(fd, root->value)) return -1;
+
+  if (root->left && save_subtree(root->left, fd, save_value)) return -1;
+  if (root->right && save_subtree(root->right, fd, save_value)) return -1;
+
+  return 0;
 }
 
   /**
-   *  @fn int avl_get_balance(avl_node *n)
+   *  @fn avl_node *load_subtree(avl *tree,
+   *                             int fd,
+   *                             avl_value_load load_value,
+   *                             int *error)
    *
-   *  @brief returns balance factor of @p n
+   *  @brief rebuild one sub-tree from its pre-order image
    *
-   *  The balance factor is the difference of the sub-tree height on the left side of @p n
-   *  and the right side of @p n.
+   *  Heights and sub-tree sizes are recomputed on the way back up; the
+   *  shape is exactly what was saved, so the result is balanced without
+   *  a single rotation.
    *
-   *  @param n - pointer to @a avl_node in tree
+   *  @param tree - pointer to @a avl struct the nodes belong to
+   *  @param fd - readable file descriptor
+   *  @param load_value - value deserializer
+   *  @param depth - recursion depth, for corruption containment
+   *  @param error - set non-zero when the image is short or corrupt
    *
-   *  @return balance factor
+   *  @return pointer to sub-tree root, NULL for an empty one or on error
    */
 
-static int avl_get_balance(avl_node *n)
+static avl_node *load_subtree(avl *tree,
+                              int fd,
+                              avl_value_load load_value,
+                              int depth,
+                              int *error)
 {
-  if (!n) return 0;
-  return height(n->left) - height(n->right);
+  unsigned char flags;
+  void *value = NULL;
+  avl_node *node;
+
+  if (*error) return NULL;
+
+    /*
+     * no valid AVL image nests deeper than this; a corrupt one must not
+     * be allowed to chew through the stack
+     */
+
+  if (depth >= AVL_MAX_HEIGHT) goto fail;
+
+  if (read_all(fd, &flags, sizeof(flags))) goto fail;
+  if (load_value(fd, &value)) goto fail;
+
+  node = avl_node_new(tree, value);
+  if (!node) goto fail;
+
+  if (flags & 1)
+  {
+    node->left = load_subtree(tree, fd, load_value, depth + 1, error);
+    if (*error) return node;
+  }
+  if (flags & 2)
+  {
+    node->right = load_subtree(tree, fd, load_value, depth + 1, error);
+    if (*error) return node;
+  }
+
+  node->height = 1 + max(height(node->left), height(node->right));
+  node->size = 1 + node_size(node->left) + node_size(node->right);
+  if (node->left) node->left->parent = node;
+  if (node->right) node->right->parent = node;
+
+  return node;
+
+fail:
+  *error = 1;
+  return NULL;
 }
 
   /**
-   *  @fn avl_node *minimum_node(avl_node *n)
+   *  @fn avl_node *_avl_node_new(avl *tree, void *value)
    *
-   *  @brief returns @a avl_node under @p n with minimum value
-   *
-   *  Given a non-empty binary search tree, return the node with minimum key
-   *  value found in that tree.  Note that the entire tree does not need to be
-   *  searched.
+   *  @brief Create a node
    *
-   *  @param n - pointer to @a avl_node in tree
+   *  @param tree - pointer to @a avl struct the node will belong to
+   *  @param value - generic pointer to any object or coerced instrisic value
    *
-   *  @return pointer to @a avl_node under @p n with minumum value
+   *  @return pointer to new @a avl_node
    */
 
-static avl_node *minimum_node(avl_node *n)
+static avl_node *_avl_node_new(avl *tree, void *value)
 {
-  avl_node *current = n;
+  avl_node *n = NULL;
+
+  if (tree && tree->arena) n = _avl_arena_alloc(tree->arena);
+  else if (tree && tree->recycle_list)
+  {
+    n = tree->recycle_list;
+    tree->recycle_list = n->right;
+    tree->recycle_count--;
+    memset(n, 0, sizeof(avl_node));
+  }
+  else if ((n = (avl_node *)malloc(sizeof(avl_node))))
+    memset(n, 0, sizeof(avl_node));
+
+  if (!n) return NULL;
 
-    /* loop down to find the leftmost leaf */
-  while (current->left != NULL) current = current->left;
+  if (tree && tree->stats_on) tree->stats.node_allocs++;
 
-  return current;
+  n->value = value;
+  n->height = 1;
+  n->size = 1;
+  n->refs = 1;
+
+  return n;
 }
 
   /**
-   *  @fn void pre_order(avl_node *root, avl_action action)
+   *  @fn void _avl_node_release(avl *tree, avl_node *node)
    *
-   *  @brief Walk the sub-tree under @p n in pre-order: root-left-right
+   *  @brief return a node to wherever it came from
    *
-   *  @param root - pointer to @a avl_node in tree
-   *  @param action - pointer to function that gets called at each node
+   *  In arena mode the node goes back on the arena freelist, after the
+   *  user supplied free_node (if any) has released the payload.
+   *  Otherwise the node is freed through free_node or free().
+   *
+   *  @param tree - pointer to @a avl struct that owns the node
+   *  @param node - pointer to @a avl_node to release
    *
    *  @par Returns
-   *  Nothing.
+   *       Nothing.
    */
 
-static void pre_order(avl_node *root, avl_action action)
+static void _avl_node_release(avl *tree, avl_node *node)
 {
-  if (!root || !action) return;
+  if (!node) return;
+
+  if (tree && tree->arena)
+  {
+    if (tree->free_node) tree->free_node(node);
+    node->left = NULL;
+    node->right = tree->arena->free_list;
+    tree->arena->free_list = node;
+    return;
+  }
+
+  if (tree && tree->recycle_limit)
+  {
+      /*
+       * recycling on: free_node is a payload release hook here, like in
+       * arena mode, and the node parks on the freelist for reuse - or,
+       * past the limit, goes straight back to the system, since the
+       * hook contract means nobody else will free it
+       */
 
-  action(root);
-  pre_order(root->left, action);
-  pre_order(root->right, action);
+    if (tree->free_node) tree->free_node(node);
+
+    if (tree->recycle_count < tree->recycle_limit)
+    {
+      node->left = NULL;
+      node->right = tree->recycle_list;
+      tree->recycle_list = node;
+      tree->recycle_count++;
+    }
+    else free(node);
+
+    return;
+  }
+
+  if (tree && tree->free_node) tree->free_node(node);
+  else free(node);
 }
 
   /**
-   *  @fn void forward_order(avl_node *root, avl_action action)
+   *  @fn avl_arena *_avl_arena_new(size_t nodes_per_slab)
    *
-   *  @brief Walk the sub-tree under @p n in forward-order: left-root-right
+   *  @brief Create a slab arena
    *
-   *  @param root - pointer to @a avl_node in tree
-   *  @param action - pointer to function that gets called at each node
+   *  @param nodes_per_slab - number of nodes per slab, 0 for the default
    *
-   *  @par Returns
-   *  Nothing.
+   *  @return pointer to new @a avl_arena
    */
 
-static void forward_order(avl_node *root, avl_action action)
+static avl_arena *_avl_arena_new(size_t nodes_per_slab)
 {
-  if (!root || !action) return;
+  avl_arena *arena = NULL;
+
+  arena = malloc(sizeof(avl_arena));
+  if (!arena) return NULL;
 
-  if (root->left) forward_order(root->left, action);
-  action(root);
-  if (root->right) forward_order(root->right, action);
+  memset(arena, 0, sizeof(avl_arena));
+  arena->nodes_per_slab = nodes_per_slab ? nodes_per_slab
+                                         : AVL_ARENA_DEFAULT_SLAB;
+
+  return arena;
 }
 
   /**
-   *  @fn void reverse_order(avl_node *root, avl_action action)
+   *  @fn void _avl_arena_free(avl_arena *arena)
    *
-   *  @brief Walk the sub-tree under @p n in reverse-order: right-root-left
+   *  @brief free an arena and every slab it owns
    *
-   *  @param root - pointer to @a avl_node in tree
-   *  @param action - pointer to function that gets called at each node
+   *  @param arena - pointer to existing @a avl_arena
    *
    *  @par Returns
-   *  Nothing.
+   *       Nothing.
    */
 
-static void reverse_order(avl_node *root, avl_action action)
+static void _avl_arena_free(avl_arena *arena)
 {
-  if (!root || !action) return;
+  avl_slab *slab, *next;
+
+  if (!arena) return;
+
+  for (slab = arena->slabs; slab; slab = next)
+  {
+    next = slab->next;
+    free(slab);
+  }
 
-  if (root->right) reverse_order(root->right, action);
-  action(root);
-  if (root->left) reverse_order(root->left, action);
+  free(arena);
 }
 
   /**
-   *  @fn void post_order(avl_node *root, avl_action action)
+   *  @fn avl_node *_avl_arena_alloc(avl_arena *arena)
    *
-   *  @brief Walk the sub-tree under @p n in post-order: left-right-root
+   *  @brief carve a node out of an arena
    *
-   *  @param root - pointer to @a avl_node in tree
-   *  @param action - pointer to function that gets called at each node
+   *  Recycled nodes are popped from the freelist first; otherwise the
+   *  node comes from the newest slab, growing the arena by one slab when
+   *  the current one is exhausted.
    *
-   *  @par Returns
-   *  Nothing.
+   *  @param arena - pointer to existing @a avl_arena
+   *
+   *  @return pointer to zeroed @a avl_node, or NULL on failure
    */
 
-static void post_order(avl_node *root, avl_action action)
+static avl_node *_avl_arena_alloc(avl_arena *arena)
 {
-  if (!root || !action) return;
+  avl_node *n = NULL;
+  avl_slab *slab;
+
+  if (!arena) return NULL;
+
+  if (arena->free_list)
+  {
+    n = arena->free_list;
+    arena->free_list = n->right;
+    memset(n, 0, sizeof(avl_node));
+    return n;
+  }
 
-  post_order(root->left, action);
-  post_order(root->right, action);
-  action(root);
+  slab = arena->slabs;
+  if (!slab || (slab->used >= arena->nodes_per_slab))
+  {
+    slab = malloc(sizeof(avl_slab) + (arena->nodes_per_slab
+                                      * sizeof(avl_node)));
+    if (!slab) return NULL;
+    slab->used = 0;
+    slab->next = arena->slabs;
+    arena->slabs = slab;
+  }
+
+  n = &slab->nodes[slab->used++];
+  memset(n, 0, sizeof(avl_node));
+
+  return n;
 }
 
   /**
-   *  @fn void tree_order(avl_node *root, avl_action action)
+   *  @fn void _avl_release_values(avl_node *root, avl_free_node free_node)
    *
-   *  @brief Walk the sub-tree under @p n in tree-order, AKA level-order:
-   *    level1-level2-...-levelN
+   *  @brief call the payload release hook on every node in a sub-tree
    *
-   *  @param root - pointer to @a avl_node in tree
-   *  @param action - pointer to function that gets called at each node
+   *  Used by avl_free() in arena mode, where the node memory itself is
+   *  reclaimed wholesale with the slabs.
+   *
+   *  @param root - pointer to @a avl_node that is root of tree
+   *  @param free_node - payload release hook
    *
    *  @par Returns
-   *  Nothing.
+   *       Nothing.
    */
 
-static void tree_order(avl_node *root, avl_action action)
+static void _avl_release_values(avl_node *root, avl_free_node free_node)
 {
-  int max;
-  int i;
-
-  if (!root || !action) return;
-
-  max = root->height;
+  if (!root) return;
 
-  for (i = max; i >= 1; --i)
-    __tree_order(root, action, i);
+  _avl_release_values(root->left, free_node);
+  _avl_release_values(root->right, free_node);
+  free_node(root);
 }
 
   /**
-   *  @fn void __tree_order(avl_node *root, avl_action action, int height)
+   *  @fn avl_node *dup_tree(avl *new_tree, avl *tree, avl_node *old_root)
    *
-   *  @brief recursive helper function for tree_order()
+   *  @brief make a structure-preserving deep copy of a sub-tree
    *
-   *  @param root - pointer to @a avl_node in tree
-   *  @param action - pointer to function that gets called at each node
-   *  @param height - height of tree under @p n
+   *  Left/right links, heights and sub-tree sizes are copied directly:
+   *  O(n) with no comparator calls and no rotations, and the copy has
+   *  exactly the shape of the original.  Should node allocation fail
+   *  partway, the affected sub-tree is omitted from the copy and the
+   *  copied ancestor counters overstate it.
    *
-   *  @par Returns
-   *  Nothing.
+   *  @param new_tree - pointer to @a avl struct the copies belong to
+   *  @param tree - pointer to existing @a avl struct
+   *  @param old_root - pointer to root @a avl_node of sub-tree to copy
+   *
+   *  @return pointer to root of the copied sub-tree, NULL for an empty one
    */
 
-static void __tree_order(avl_node *root, avl_action action, int height)
+static avl_node *dup_tree(avl *new_tree, avl *tree, avl_node *old_root)
 {
-  if (!root || !action) return;
+  avl_node *node = NULL;
+
+  if (!new_tree || !tree || !old_root) return NULL;
+
+  node = avl_node_dup(new_tree, old_root);
+  if (!node) return NULL;
 
-  
-  if (root->height == height) action(root);
+  node->left = dup_tree(new_tree, tree, old_root->left);
+  node->right = dup_tree(new_tree, tree, old_root->right);
+  node->height = old_root->height;
+  node->size = old_root->size;
+  node->refs = 1;
+  node->parent = NULL;
+  if (node->left) node->left->parent = node;
+  if (node->right) node->right->parent = node;
 
-  __tree_order(root->left, action, height);
-  __tree_order(root->right, action, height);
+  return node;
 }
 
   /**
-   *  @fn avl_node *_avl_node_new(void *value)
+   *  @fn int dup_collect_tasks(avl *new_tree,
+   *                            avl *tree,
+   *                            avl_node *src,
+   *                            avl_node **dst,
+   *                            int level,
+   *                            dup_task *tasks,
+   *                            size_t *ntasks)
    *
-   *  @brief Create a node
+   *  @brief clone the top @p level levels of a tree, queueing the
+   *         sub-trees hanging below them as clone tasks
    *
-   *  @param value - generic pointer to any object or coerced instrisic value
+   *  @param new_tree - pointer to @a avl struct the copies belong to
+   *  @param tree - pointer to existing @a avl struct
+   *  @param src - pointer to root @a avl_node of sub-tree
+   *  @param dst - slot in the copy that receives this sub-tree
+   *  @param parent - skeleton node owning @p dst, NULL at the root
+   *  @param level - number of levels left to clone sequentially
+   *  @param tasks - task array being filled
+   *  @param ntasks - number of tasks queued so far
    *
-   *  @return pointer to new @a avl_node
+   *  @return 0 on success, -1 on allocation failure
    */
 
-static avl_node *_avl_node_new(void *value)
+static int dup_collect_tasks(avl *new_tree,
+                             avl *tree,
+                             avl_node *src,
+                             avl_node **dst,
+                             avl_node *parent,
+                             int level,
+                             dup_task *tasks,
+                             size_t *ntasks)
 {
-  avl_node *n = NULL;
+  avl_node *node;
 
-  if ((n = (avl_node *)malloc(sizeof(avl_node))))
-    memset(n, 0, sizeof(avl_node));
+  if (!src)
+  {
+    *dst = NULL;
+    return 0;
+  }
 
-  n->value = value;
-  n->height = 1;
+  if (level == 0)
+  {
+    tasks[*ntasks].src = src;
+    tasks[*ntasks].dst = dst;
+    tasks[*ntasks].parent = parent;
+    (*ntasks)++;
+    return 0;
+  }
 
-  return n;
+  node = avl_node_dup(new_tree, src);
+  if (!node) return -1;
+
+  node->height = src->height;
+  node->size = src->size;
+  node->refs = 1;
+  node->left = NULL;
+  node->right = NULL;
+  node->parent = parent;
+  *dst = node;
+
+  if (dup_collect_tasks(new_tree, tree, src->left, &node->left,
+                        node, level - 1, tasks, ntasks)) return -1;
+  return dup_collect_tasks(new_tree, tree, src->right, &node->right,
+                           node, level - 1, tasks, ntasks);
 }
 
   /**
-   *  @fn void dup_tree(avl *tree, avl_node **new_root, avl_node *old_root)
+   *  @fn void *dup_worker(void *arg)
    *
-   *  @brief make a deep copy of an entire AVL tree
+   *  @brief worker thread body for avl_dup_parallel()
    *
-   *  @param tree - pointer to existing @a avl struct
-   *  @param new_root - address of pointer to root @a avl_node of new tree
-   *  @param old_root - pointer to root @a avl_node of existing tree
+   *  Clones every task at start, start+stride, ... from the shared task
+   *  array; the strided split needs no locking since each task touches
+   *  a distinct slot of the copy.
    *
-   *  @par Returns
-   *       Nothing.
+   *  @param arg - pointer to this worker's @a dup_worker_args
+   *
+   *  @return NULL
    */
 
-static void dup_tree(avl *tree, avl_node **new_root, avl_node *old_root)
+static void *dup_worker(void *arg)
 {
-  avl_node *node = NULL;
-
-  if (!tree || !new_root || !old_root) return;
+  dup_worker_args *args = arg;
+  size_t i;
 
-  if (old_root->left) dup_tree(tree, new_root, old_root->left);
-
-  node = avl_node_dup(tree, old_root);
-  if (node) *new_root = _avl_insert(*new_root, node, tree->cmp_node);
+  for (i = args->start; i < args->ntasks; i += args->stride)
+  {
+    *args->tasks[i].dst = dup_tree(args->new_tree, args->tree,
+                                   args->tasks[i].src);
+    if (*args->tasks[i].dst)
+      (*args->tasks[i].dst)->parent = args->tasks[i].parent;
+  }
 
-  if (old_root->right) dup_tree(tree, new_root, old_root->right);
+  return NULL;
 }
 
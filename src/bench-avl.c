@@ -0,0 +1,372 @@
+/*
+ *  Copyright 2021,2024,2025 Patrick T. Head
+ *
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file bench-avl.c
+ * @brief Benchmark harness for the AVL library
+ *
+ * Runs parameterized workloads over libavl and reports throughput and
+ * latency percentiles in CSV on stdout, one row per (workload, op):
+ *
+ *   workload,op,n,ops,secs,ops_per_sec,p50_ns,p99_ns,p999_ns
+ *
+ * Usage: bench-avl [-n nodes] [-k seq|rand|zipf] [-s seed] [-a]
+ *
+ *   -n  tree size (default 1000000)
+ *   -k  key pattern (default: run all three)
+ *   -s  RNG seed (default 1)
+ *   -a  use the arena allocator for the tree under test
+ *
+ * Per-op latency is sampled (every 64th op) to keep timer overhead out
+ * of the throughput numbers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "avl.h"
+
+#define LAT_SAMPLE_SHIFT 6                       /* every 64th op       */
+#define LAT_MAX_SAMPLES  (1u << 20)              /* per measured phase  */
+
+static unsigned long long rng_state;
+
+static unsigned long long rng_next(void)
+{
+  unsigned long long x = rng_state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  rng_state = x;
+
+  return x;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (long long)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+  /*
+   * key patterns: each maps op index i to a key in [0, 4n)
+   */
+
+static long key_seq(long i, long n)
+{
+  (void)n;
+
+  return i;
+}
+
+static long key_rand(long i, long n)
+{
+  (void)i;
+
+  return (long)(rng_next() % (unsigned long long)(4 * n));
+}
+
+static long key_zipf(long i, long n)
+{
+    /*
+     * crude zipf-ish skew: square a uniform fraction so small keys are
+     * drawn far more often than large ones
+     */
+
+  double u = (double)(rng_next() % 1000000007ull) / 1000000007.0;
+
+  (void)i;
+
+  return (long)(u * u * (double)(4 * n));
+}
+
+typedef long (*key_fn)(long i, long n);
+
+static int cmp_longs(const void *a, const void *b)
+{
+  long x = *(const long *)a, y = *(const long *)b;
+
+  return (x > y) - (x < y);
+}
+
+static long long lat_samples[LAT_MAX_SAMPLES];
+static size_t lat_count;
+
+static void lat_reset(void)
+{
+  lat_count = 0;
+}
+
+static void lat_add(long long ns)
+{
+  if (lat_count < LAT_MAX_SAMPLES) lat_samples[lat_count++] = ns;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+
+  return (x > y) - (x < y);
+}
+
+static long long lat_pct(double pct)
+{
+  size_t idx;
+
+  if (!lat_count) return 0;
+
+  idx = (size_t)(pct * (double)(lat_count - 1));
+
+  return lat_samples[idx];
+}
+
+static void report(const char *workload,
+                   const char *op,
+                   long n,
+                   long ops,
+                   double secs)
+{
+  qsort(lat_samples, lat_count, sizeof(long long), cmp_ll);
+
+  printf("%s,%s,%ld,%ld,%.6f,%.0f,%lld,%lld,%lld\n",
+         workload, op, n, ops, secs,
+         secs > 0.0 ? (double)ops / secs : 0.0,
+         lat_pct(0.50), lat_pct(0.99), lat_pct(0.999));
+}
+
+  /*
+   * one full workload: build a tree with the given key pattern, then
+   * measure find hit/miss, walk, dup, delete+reinsert churn
+   */
+
+static void run_workload(const char *name, key_fn keys, long n, int use_arena)
+{
+  avl *tree, *copy;
+  avl_node probe;
+  avl_node **items;
+  double t0;
+  long long s0;
+  long i, ops;
+  volatile long sink = 0;
+
+  tree = use_arena ? avl_new_with_arena(0) : avl_new();
+  if (!tree)
+  {
+    fprintf(stderr, "bench-avl: out of memory\n");
+    exit(1);
+  }
+
+    /*
+     * the tree under test is integer-keyed through the built-in flavor
+     */
+
+  tree->key_kind = avl_key_i64;
+
+  memset(&probe, 0, sizeof(probe));
+
+    /*
+     * insert
+     */
+
+  lat_reset();
+  t0 = now();
+  for (i = 0; i < n; i++)
+  {
+    if (!(i & ((1 << LAT_SAMPLE_SHIFT) - 1)))
+    {
+      s0 = now_ns();
+      avl_insert_value(tree, (void *)keys(i, n));
+      lat_add(now_ns() - s0);
+    }
+    else avl_insert_value(tree, (void *)keys(i, n));
+  }
+  report(name, "insert", n, n, now() - t0);
+
+    /*
+     * find, mostly hits (keys drawn from the same pattern)
+     */
+
+  lat_reset();
+  ops = n;
+  t0 = now();
+  for (i = 0; i < ops; i++)
+  {
+    probe.value = (void *)keys(i, n);
+    if (!(i & ((1 << LAT_SAMPLE_SHIFT) - 1)))
+    {
+      s0 = now_ns();
+      sink += avl_find(tree, &probe) != NULL;
+      lat_add(now_ns() - s0);
+    }
+    else sink += avl_find(tree, &probe) != NULL;
+  }
+  report(name, "find", n, ops, now() - t0);
+
+    /*
+     * find, guaranteed misses (outside the key range)
+     */
+
+  lat_reset();
+  t0 = now();
+  for (i = 0; i < ops; i++)
+  {
+    probe.value = (void *)(4 * n + 1 + (long)(rng_next() % (unsigned)n));
+    if (!(i & ((1 << LAT_SAMPLE_SHIFT) - 1)))
+    {
+      s0 = now_ns();
+      sink += avl_find(tree, &probe) != NULL;
+      lat_add(now_ns() - s0);
+    }
+    else sink += avl_find(tree, &probe) != NULL;
+  }
+  report(name, "find-miss", n, ops, now() - t0);
+
+    /*
+     * full in-order walk through the cursor (no callback per node)
+     */
+
+  lat_reset();
+  t0 = now();
+  {
+    avl_iter *iter = avl_iter_begin(tree, avl_forward_order);
+    avl_node *node;
+
+    while ((node = avl_iter_next(iter))) sink += (long)node->value;
+    avl_iter_end(iter);
+  }
+  ops = (long)avl_count(tree);
+  report(name, "walk", n, ops, now() - t0);
+
+    /*
+     * structure-preserving dup
+     */
+
+  lat_reset();
+  t0 = now();
+  copy = avl_dup(tree);
+  report(name, "dup", n, (long)avl_count(tree), now() - t0);
+  avl_free(copy);
+
+    /*
+     * delete half the keys, reinsert them: steady-state churn
+     */
+
+  lat_reset();
+  ops = 0;
+  t0 = now();
+  for (i = 0; i < n; i += 2)
+  {
+    probe.value = (void *)keys(i, n);
+    if (!(i & ((1 << LAT_SAMPLE_SHIFT) - 1)))
+    {
+      s0 = now_ns();
+      ops += avl_delete(tree, &probe) == 0;
+      lat_add(now_ns() - s0);
+    }
+    else ops += avl_delete(tree, &probe) == 0;
+  }
+  for (i = 0; i < n; i += 2)
+  {
+    avl_insert_value(tree, (void *)keys(i, n));
+    ops++;
+  }
+  report(name, "churn", n, ops, now() - t0);
+
+    /*
+     * bulk load from sorted input, for comparison with insert
+     */
+
+  items = malloc((size_t)n * sizeof(avl_node *));
+  {
+    long *sorted = malloc((size_t)n * sizeof(long));
+    long m = 0;
+    avl *bulk = avl_new_i64();
+
+    if (items && sorted && bulk)
+    {
+      for (i = 0; i < n; i++) sorted[i] = keys(i, n);
+      qsort(sorted, (size_t)n, sizeof(long), cmp_longs);
+      for (i = 0; i < n; i++)
+        if (!m || (sorted[i] != sorted[m - 1])) sorted[m++] = sorted[i];
+
+      for (i = 0; i < m; i++) items[i] = avl_node_new(bulk, (void *)sorted[i]);
+
+      lat_reset();
+      t0 = now();
+      avl_build_sorted(bulk, items, (size_t)m);
+      report(name, "build-sorted", n, m, now() - t0);
+    }
+
+    avl_free(bulk);
+    free(items);
+    free(sorted);
+  }
+
+  avl_free(tree);
+
+  (void)sink;
+}
+
+int main(int argc, char **argv)
+{
+  long n = 1000000;
+  const char *pattern = NULL;
+  int use_arena = 0;
+  unsigned long long seed = 1;
+  int i;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-n") && (i + 1 < argc)) n = atol(argv[++i]);
+    else if (!strcmp(argv[i], "-k") && (i + 1 < argc)) pattern = argv[++i];
+    else if (!strcmp(argv[i], "-s") && (i + 1 < argc))
+      seed = strtoull(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "-a")) use_arena = 1;
+    else
+    {
+      fprintf(stderr,
+              "usage: bench-avl [-n nodes] [-k seq|rand|zipf] [-s seed] [-a]\n");
+      return 1;
+    }
+  }
+
+  if (n < 1) n = 1;
+  rng_state = seed ? seed : 1;
+
+  printf("workload,op,n,ops,secs,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+
+  if (!pattern || !strcmp(pattern, "seq")) run_workload("seq", key_seq, n, use_arena);
+  if (!pattern || !strcmp(pattern, "rand")) run_workload("rand", key_rand, n, use_arena);
+  if (!pattern || !strcmp(pattern, "zipf")) run_workload("zipf", key_zipf, n, use_arena);
+
+  return 0;
+}
@@ -1,8 +1,20 @@
 #include <stdlib.h>
 #include <stdio.h> 
+#include <unistd.h>
 
 #include "avl.h"
 
+static int failures = 0;
+
+static void check(int cond, const char *what)
+{
+  if (!cond)
+  {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
+
 int compare(avl_node *a, avl_node *b)
 {
   int va, vb;
@@ -19,10 +31,380 @@ int compare(avl_node *a, avl_node *b)
   return 0;
 }
 
-void action(avl_node *n)
+int action(avl_node *n)
 {
-  if (!n) return;
+  if (!n) return 0;
   printf("%d ", (int)((long long)n->value));
+  return 0;
+}
+
+  /*
+   * behavior checks for the newer surfaces; each section builds its own
+   * tree and reports through check()
+   */
+
+static void test_snapshot(void)
+{
+  avl *tree, *snap;
+  avl_node probe = { 0 };
+  long i;
+
+  tree = avl_new_i64();
+  for (i = 0; i < 1000; i++) avl_insert_value(tree, (void *)i);
+
+  snap = avl_snapshot(tree);
+  check(snap != NULL, "snapshot created");
+  check(avl_count(snap) == 1000, "snapshot count frozen");
+
+  probe.value = (void *)0;
+  avl_delete(tree, &probe);
+  avl_insert_value(tree, (void *)5000);
+
+  check(avl_count(tree) == 1000, "live count after churn");
+  check(avl_count(snap) == 1000, "snapshot count after live churn");
+  check(avl_find(snap, &probe) != NULL, "snapshot keeps deleted key");
+  check(avl_find(tree, &probe) == NULL, "live tree dropped key");
+  probe.value = (void *)5000;
+  check(avl_find(snap, &probe) == NULL, "snapshot lacks new key");
+  check(avl_insert_value(snap, (void *)7) == -1, "snapshot refuses insert");
+
+  avl_free(snap);
+  probe.value = (void *)500;
+  check(avl_find(tree, &probe) != NULL, "live tree intact after snapshot free");
+  avl_free(tree);
+}
+
+static void test_recycle(void)
+{
+  avl *tree, *copy, *lo, *hi;
+  avl_node probe = { 0 };
+  long i;
+
+  tree = avl_new_i64();
+  check(avl_set_recycle(tree, 64) == 0, "recycling enabled");
+  for (i = 0; i < 200; i++) avl_insert_value(tree, (void *)i);
+  for (i = 0; i < 100; i++)
+  {
+    probe.value = (void *)i;
+    avl_delete(tree, &probe);
+  }
+  check(tree->recycle_count == 64, "freelist bounded at limit");
+
+    /*
+     * regression: tree copies must not share the parked freelist
+     */
+
+  copy = avl_dup(tree);
+  check(copy && !copy->recycle_list && !copy->recycle_count,
+        "dup does not inherit freelist");
+  avl_free(copy);
+  check(tree->recycle_count == 64, "source freelist survives dup free");
+  avl_insert_value(tree, (void *)1000);
+  check(tree->recycle_count == 63, "source freelist still pops");
+
+  check(avl_split(tree, &probe, &lo, &hi) == 0, "split with parked nodes");
+  check(!lo->recycle_list && !hi->recycle_list,
+        "split halves do not inherit freelist");
+  avl_free(lo);
+  avl_free(hi);
+  avl_free(tree);
+}
+
+static void test_multiset(void)
+{
+  avl *tree;
+  avl_node probe = { 0 };
+  long i, j;
+
+  tree = avl_new_i64();
+  check(avl_set_multi(tree, 1) == 0, "multiset enabled");
+
+  for (i = 0; i < 10; i++)
+    for (j = 0; j <= i; j++) avl_insert_value(tree, (void *)i);
+
+  check(avl_count(tree) == 55, "occurrence-weighted count");
+  check((long)avl_select(tree, 3)->value == 2, "weighted select");
+  probe.value = (void *)3;
+  check(avl_rank(tree, &probe) == 6, "weighted rank");
+
+  check(avl_delete(tree, &probe) == 0, "delete one occurrence");
+  check(avl_count(tree) == 54, "count after decrement");
+  check(avl_find(tree, &probe) != NULL, "key still present");
+
+    /*
+     * regression: splicing out a two-child victim whose successor has
+     * multiplicity > 1 must move the whole occurrence count
+     */
+
+  {
+    avl *t2 = avl_new_i64();
+    long keys[] = { 10, 5, 15, 3, 7, 12, 17, 11, 13 };
+
+    avl_set_multi(t2, 1);
+    for (i = 0; i < 9; i++) avl_insert_value(t2, (void *)keys[i]);
+    avl_insert_value(t2, (void *)11);
+    avl_insert_value(t2, (void *)11);
+
+    probe.value = (void *)10;
+    avl_delete(t2, &probe);
+    check(avl_count(t2) == 10, "splice keeps successor occurrences");
+    probe.value = (void *)11;
+    check(avl_rank(t2, &probe) == 3, "rank after splice");
+    avl_free(t2);
+  }
+
+  check(avl_compact_from(tree) == NULL, "compact refuses multiset");
+  avl_free(tree);
+}
+
+static void test_join_split(void)
+{
+  avl *a, *b, *c, *lo, *hi;
+  avl_node probe = { 0 };
+  long i;
+
+  a = avl_new_i64();
+  b = avl_new_i64();
+  for (i = 0; i < 100; i++) avl_insert_value(a, (void *)i);
+  for (i = 100; i < 150; i++) avl_insert_value(b, (void *)i);
+
+  check(avl_join(a, b) == 0, "join disjoint trees");
+  check(avl_count(a) == 150, "joined count");
+  check(avl_count(b) == 0, "right tree emptied");
+  check((long)avl_last(a)->value == 149, "joined maximum");
+
+  c = avl_new_i64();
+  avl_insert_value(c, (void *)50);
+  check(avl_join(a, c) == -1, "overlapping join refused");
+
+  probe.value = (void *)100;
+  check(avl_split(a, &probe, &lo, &hi) == 0, "split at pivot");
+  check(avl_count(lo) == 100 && avl_count(hi) == 50, "split counts");
+  check((long)avl_last(lo)->value == 99, "lo below pivot");
+  check((long)avl_first(hi)->value == 100, "hi from pivot");
+
+  avl_free(a);
+  avl_free(b);
+  avl_free(c);
+  avl_free(lo);
+  avl_free(hi);
+}
+
+static void test_persistence(void)
+{
+  avl *tree, *loaded;
+  avl_compact *compact, *mapped;
+  FILE *file;
+  int fd;
+  long i;
+
+  tree = avl_new_i64();
+  for (i = 0; i < 300; i++) avl_insert_value(tree, (void *)(i * 3));
+
+    /*
+     * avl_save / avl_load round trip
+     */
+
+  file = tmpfile();
+  check(file != NULL, "scratch file for save");
+  if (!file)
+  {
+    avl_free(tree);
+    return;
+  }
+  fd = fileno(file);
+
+  check(avl_save(tree, fd, NULL) == 0, "save tree");
+  lseek(fd, 0, SEEK_SET);
+  loaded = avl_load(fd, NULL);
+  check(loaded != NULL, "load tree");
+  if (loaded)
+  {
+    check(avl_count(loaded) == 300, "loaded count");
+    check(loaded->height == tree->height, "loaded height");
+    check((long)avl_select(loaded, 100)->value == 300, "loaded select");
+    avl_free(loaded);
+  }
+  fclose(file);
+
+    /*
+     * regression: a multiset image would carry a weighted count that
+     * one record per node can never satisfy, so saving is refused
+     */
+
+  {
+    avl *multi = avl_new_i64();
+
+    avl_set_multi(multi, 1);
+    avl_insert_value(multi, (void *)1);
+    avl_insert_value(multi, (void *)1);
+
+    file = tmpfile();
+    if (file)
+    {
+      check(avl_save(multi, fileno(file), NULL) == -1,
+            "save refuses multiset");
+      fclose(file);
+    }
+    avl_free(multi);
+  }
+
+    /*
+     * avl_compact_save / avl_compact_map round trip
+     */
+
+  compact = avl_compact_from(tree);
+  check(compact != NULL, "compact for save");
+
+  file = tmpfile();
+  if (compact && file)
+  {
+    fd = fileno(file);
+    check(avl_compact_save(compact, fd) == 0, "compact save");
+    lseek(fd, 0, SEEK_SET);
+    mapped = avl_compact_map(fd);
+    check(mapped != NULL, "compact map");
+    if (mapped)
+    {
+      check(avl_compact_count(mapped) == 300, "mapped count");
+      check((long)avl_compact_find(mapped, (void *)297) == 297, "mapped hit");
+      check(avl_compact_find(mapped, (void *)5) == NULL, "mapped miss");
+      avl_compact_free(mapped);
+    }
+    fclose(file);
+  }
+  if (compact) avl_compact_free(compact);
+
+  avl_free(tree);
+}
+
+static void test_loader(void)
+{
+  avl *tree;
+  avl_loader *loader;
+  long i;
+
+  tree = avl_new_i64();
+  loader = avl_loader_begin(tree);
+  check(loader != NULL, "loader opened");
+
+    /*
+     * mostly sorted feed with an out-of-order record and a duplicate
+     */
+
+  for (i = 0; i < 100; i++)
+    check(avl_loader_add(loader, avl_node_new(tree, (void *)(i * 2))) == 0,
+          "loader add");
+  check(avl_loader_add(loader, avl_node_new(tree, (void *)55)) == 0,
+        "loader out-of-order add");
+  check(avl_loader_add(loader, avl_node_new(tree, (void *)54)) == 0,
+        "loader duplicate add");
+  check(avl_loader_end(loader) == 0, "loader closed");
+
+  check(avl_count(tree) == 101, "loaded count");
+  check((long)avl_first(tree)->value == 0, "loaded minimum");
+  check((long)avl_last(tree)->value == 198, "loaded maximum");
+  check(avl_find_key(tree, (void *)55) != NULL, "out-of-order key present");
+
+  avl_free(tree);
+}
+
+static void test_queries(void)
+{
+  avl *tree;
+  avl_iter *iter;
+  avl_node *node;
+  avl_node lo = { 0 }, hi = { 0 };
+  long i, seen;
+
+  tree = avl_new_i64();
+  for (i = 0; i < 100; i++) avl_insert_value(tree, (void *)(i * 2));
+
+    /*
+     * cursor: full scan and seek
+     */
+
+  iter = avl_iter_begin(tree, avl_forward_order);
+  seen = 0;
+  while (avl_iter_next(iter)) seen++;
+  check(seen == 100, "cursor full scan");
+  lo.value = (void *)51;
+  check(avl_iter_seek(iter, &lo) == 0, "cursor seek");
+  node = avl_iter_next(iter);
+  check(node && ((long)node->value == 52), "cursor seek lands after key");
+  avl_iter_end(iter);
+
+    /*
+     * range cursor
+     */
+
+  lo.value = (void *)10;
+  hi.value = (void *)20;
+  iter = avl_iter_begin_range(tree, &lo, &hi);
+  seen = 0;
+  while (avl_iter_next(iter)) seen++;
+  check(seen == 6, "range cursor count");
+  avl_iter_end(iter);
+
+    /*
+     * batched lookup
+     */
+
+  {
+    avl_node probes[3];
+    avl_node *targets[3], *results[3];
+
+    for (i = 0; i < 3; i++)
+    {
+      avl_node_init(&probes[i], (void *)(i * 100 + 2));
+      targets[i] = &probes[i];
+    }
+    check(avl_find_many(tree, targets, results, 3) == 2, "find_many hits");
+    check(results[0] && results[1] && !results[2], "find_many result slots");
+  }
+
+    /*
+     * order statistics
+     */
+
+  check((long)avl_select(tree, 50)->value == 100, "select");
+  lo.value = (void *)100;
+  check(avl_rank(tree, &lo) == 50, "rank");
+  check(avl_select(tree, 100) == NULL, "select out of range");
+
+  avl_free(tree);
+}
+
+static int compact_seen;
+
+static int compact_count_cb(void *value)
+{
+  (void)value;
+  compact_seen++;
+  return 0;
+}
+
+static void test_compact(void)
+{
+  avl *tree;
+  avl_compact *compact;
+  long i;
+
+  tree = avl_new_i64();
+  for (i = 0; i < 500; i++) avl_insert_value(tree, (void *)(i + 1));
+
+  compact = avl_compact_from(tree);
+  check(compact != NULL, "compact built");
+  check(avl_compact_count(compact) == 500, "compact count");
+  check((long)avl_compact_find(compact, (void *)123) == 123, "compact hit");
+  check(avl_compact_find(compact, (void *)9999) == NULL, "compact miss");
+
+  compact_seen = 0;
+  avl_compact_walk(compact, compact_count_cb);
+  check(compact_seen == 500, "compact walk visits all");
+
+  avl_compact_free(compact);
+  avl_free(tree);
 }
 
 int main() 
@@ -49,23 +431,23 @@ int main()
   avl_insert(tree, avl_node_new(tree, (void *)32));
 
   printf("Preorder traversal of the constructed AVL tree is\n"); 
-  avl_walk(tree, avl_pre_order, (avl_action)action); 
+  avl_walk(tree, avl_pre_order, action); 
   printf("\n");
 
   printf("Forward order traversal of the constructed AVL tree is\n");
-  avl_walk(tree, avl_forward_order, (avl_action)action); 
+  avl_walk(tree, avl_forward_order, action); 
   printf("\n");
 
   printf("Reverse order traversal of the constructed AVL tree is\n");
-  avl_walk(tree, avl_reverse_order, (avl_action)action); 
+  avl_walk(tree, avl_reverse_order, action); 
   printf("\n");
 
   printf("Postorder traversal of the constructed AVL tree is\n");
-  avl_walk(tree, avl_post_order, (avl_action)action); 
+  avl_walk(tree, avl_post_order, action); 
   printf("\n");
 
   printf("Tree order traversal of the constructed AVL tree is\n");
-  avl_walk(tree, avl_tree_order, (avl_action)action);
+  avl_walk(tree, avl_tree_order, action);
   printf("\n");
 
   temp = avl_node_new(tree, (void *)16);
@@ -77,13 +459,14 @@ int main()
   printf("avl_delete() returned %d\n", rv);
 
   printf("Forward traversal after delete(16) is\n");
-  avl_walk(tree, avl_forward_order, (avl_action)action); 
+  avl_walk(tree, avl_forward_order, action); 
   printf("\n");
 
   node = avl_find(tree, temp);
   if (node) printf("16 found, node->key=%d\n", (int)((long long)node->value));
   else printf("16 not found\n");
 
+  avl_node_free(tree, temp);
   temp = avl_node_new(tree, (void *)25);
   node = avl_find(tree, temp);
   if (node) printf("25 found, node->key=%d\n", (int)((long long)node->value));
@@ -93,13 +476,14 @@ int main()
   printf("avl_delete() returned %d\n", rv);
 
   printf("Forward traversal after delete(25) is\n");
-  avl_walk(tree, avl_forward_order, (avl_action)action); 
+  avl_walk(tree, avl_forward_order, action); 
   printf("\n");
 
   node = avl_find(tree, temp);
   if (node) printf("25 found, node->key=%d\n", (int)((long long)node->value));
   else printf("25 not found\n");
 
+  avl_node_free(tree, temp);
   temp = avl_node_new(tree, (void *)40);
   node = avl_find(tree, temp);
   if (node) printf("40 found, node->key=%d\n", (int)((long long)node->value));
@@ -109,7 +493,7 @@ int main()
   printf("avl_delete() returned %d\n", rv);
 
   printf("Forward traversal after delete(40) is\n");
-  avl_walk(tree, avl_forward_order, (avl_action)action); 
+  avl_walk(tree, avl_forward_order, action); 
   printf("\n");
 
   node = avl_find(tree, temp);
@@ -117,11 +501,24 @@ int main()
   else printf("40 not found\n");
 
   printf("Tree order traversal after deletions is\n");
-  avl_walk(tree, avl_tree_order, (avl_action)action);
+  avl_walk(tree, avl_tree_order, action);
   printf("\n");
 
+  avl_node_free(tree, temp);
   avl_free(tree);
 
-  return 0; 
+  test_snapshot();
+  test_recycle();
+  test_multiset();
+  test_join_split();
+  test_compact();
+  test_persistence();
+  test_loader();
+  test_queries();
+
+  if (failures) printf("%d check(s) FAILED\n", failures);
+  else printf("all checks passed\n");
+
+  return failures ? 1 : 0; 
 } 
 